@@ -0,0 +1,611 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <benchmark/benchmark.h>
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "tagged_sqlite.h"
+
+using namespace skydown::literals;
+
+// A database file with the orders table from example.cpp, deleted when done.
+// The table is STRICT, so that scans use the unchecked reads when built with
+// TAGGED_SQLITE_COLUMN_METADATA.
+class orders_db {
+  std::string path_;
+  sqlite3 *sqldb_ = nullptr;
+
+ public:
+  explicit orders_db(const char *name = "tagged_sqlite_bm.db")
+      : path_((std::filesystem::temp_directory_path() / name).string()) {
+    std::filesystem::remove(path_);
+    sqlite3_open(path_.c_str(), &sqldb_);
+    skydown::statement_cache::enable(sqldb_);
+    skydown::prepared_statement<
+        "CREATE TABLE orders("
+        "id INTEGER NOT NULL PRIMARY KEY,"
+        "item TEXT NOT NULL, "
+        "customerid INTEGER NOT NULL,"
+        "price REAL NOT NULL, "
+        "discount_code TEXT "
+        ") STRICT;"  //
+        >{sqldb_}
+        .execute();
+  }
+  ~orders_db() {
+    skydown::statement_cache::clear(sqldb_);
+    sqlite3_close(sqldb_);
+    std::filesystem::remove(path_);
+  }
+  sqlite3 *get() const { return sqldb_; }
+};
+
+using insert_order = skydown::prepared_statement<
+    "INSERT INTO orders(item , customerid , price, discount_code ) "
+    "VALUES (?item:text, ?customerid:integer, ?price:real, "
+    "?discount_code:text? );"  //
+    >;
+
+auto make_order(std::int64_t i) {
+  return skydown::sqlite_experimental::tagged_tuple{
+      "item"_param = std::string_view("Phone"), "customerid"_param = i % 100,
+      "price"_param = 1444.44};
+}
+
+static void BM_InsertOrdersAutocommit(benchmark::State &state) {
+  orders_db db;
+  insert_order insert{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+      insert.execute_tuple(make_order(i));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+static void BM_InsertOrdersExecuteMany(benchmark::State &state) {
+  orders_db db;
+  insert_order insert{db.get()};
+  std::vector<decltype(make_order(0))> orders;
+  for (std::int64_t i = 0; i < state.range(0); ++i) {
+    orders.push_back(make_order(i));
+  }
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    insert.execute_many(orders);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+static void BM_InsertOrdersBatchWriter(benchmark::State &state) {
+  orders_db db;
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    skydown::batch_writer<
+        "INSERT INTO orders(item , customerid , price, discount_code ) "
+        "VALUES (?item:text, ?customerid:integer, ?price:real, "
+        "?discount_code:text? );"  //
+        >
+        writer{db.get()};
+    for (std::int64_t i = 0; i < state.range(0); ++i) {
+      writer.write("item"_param = std::string_view("Phone"),
+                   "customerid"_param = i % 100, "price"_param = 1444.44);
+    }
+    writer.finish();
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Inserts 4KB of text per row into an in memory database, so that copying the
+// text is a large part of the cost.
+class notes_db {
+  sqlite3 *sqldb_ = nullptr;
+
+ public:
+  notes_db() {
+    sqlite3_open(":memory:", &sqldb_);
+    skydown::statement_cache::enable(sqldb_);
+    skydown::prepared_statement<"CREATE TABLE notes(body TEXT NOT NULL);">{
+        sqldb_}
+        .execute();
+  }
+  ~notes_db() {
+    skydown::statement_cache::clear(sqldb_);
+    sqlite3_close(sqldb_);
+  }
+  sqlite3 *get() const { return sqldb_; }
+};
+
+constexpr int notes_per_iteration = 1000;
+
+static void BM_InsertLongText(benchmark::State &state) {
+  notes_db db;
+  std::string body(4096, 'x');
+  skydown::prepared_statement<"INSERT INTO notes(body) VALUES(?body:text);">
+      insert{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    skydown::transaction t(db.get());
+    for (int i = 0; i < notes_per_iteration; ++i) {
+      insert.execute("body"_param = std::string_view(body));
+    }
+    t.commit();
+  }
+  state.SetItemsProcessed(state.iterations() * notes_per_iteration);
+}
+
+// The same inserts through the C API, with SQLite copying the text.
+static void BM_InsertLongTextTransient(benchmark::State &state) {
+  notes_db db;
+  std::string body(4096, 'x');
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db.get(), "INSERT INTO notes(body) VALUES(?);", -1, &stmt,
+                     nullptr);
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    skydown::transaction t(db.get());
+    for (int i = 0; i < notes_per_iteration; ++i) {
+      sqlite3_reset(stmt);
+      sqlite3_bind_text(stmt, 1, body.data(), static_cast<int>(body.size()),
+                        SQLITE_TRANSIENT);
+      sqlite3_step(stmt);
+    }
+    t.commit();
+  }
+  sqlite3_finalize(stmt);
+  state.SetItemsProcessed(state.iterations() * notes_per_iteration);
+}
+
+void fill_orders(sqlite3 *sqldb, std::int64_t rows) {
+  skydown::batch_writer<
+      "INSERT INTO orders(item , customerid , price, discount_code ) "
+      "VALUES (?item:text, ?customerid:integer, ?price:real, "
+      "?discount_code:text? );"  //
+      >
+      writer{sqldb, 100000};
+  for (std::int64_t i = 0; i < rows; ++i) {
+    writer.write("item"_param = std::string_view("Phone"),
+                 "customerid"_param = i % 100, "price"_param = 1444.44);
+  }
+  writer.finish();
+}
+
+static void BM_ScanOrders(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  skydown::prepared_statement<
+      "SELECT id:integer, item:text, customerid:integer, price:real, "
+      "discount_code:text? FROM orders;"  //
+      >
+      select_orders{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    double total = 0;
+    for (auto &row : select_orders.execute_rows()) {
+      total += row["price"_col] + static_cast<double>(row["item"_col].size());
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Per row work of the processing benchmarks, about as costly as stepping.
+double process_order(double price, std::string_view item) {
+  double v = price;
+  for (int i = 0; i < 64; ++i) {
+    v = v * 1.0000001 + static_cast<double>(item[i % item.size()]);
+  }
+  return v;
+}
+
+using select_all_orders = skydown::prepared_statement<
+    "SELECT id:integer, item:text, customerid:integer, price:real, "
+    "discount_code:text? FROM orders;"  //
+    >;
+
+static void BM_ProcessOrders(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  select_all_orders select_orders{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    double total = 0;
+    for (auto &row : select_orders.execute_rows()) {
+      total += process_order(row["price"_col], row["item"_col]);
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// range(1) is whether to step on a helper thread.
+static void BM_ProcessOrdersBuffered(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  select_all_orders select_orders{db.get()};
+  skydown::row_buffering buffering{.rows = 1024,
+                                   .helper_thread = state.range(1) != 0};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    double total = 0;
+    for (auto &row : select_orders.execute_rows_buffered(buffering)) {
+      total += process_order(row["price"_col], row["item"_col]);
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Runs the tasks in order on one worker thread.
+class thread_executor {
+  std::mutex mutex_;
+  std::condition_variable cvar_;
+  std::deque<std::function<void()>> tasks_;
+  bool done_ = false;
+  std::thread worker_;
+
+  void run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+      cvar_.wait(lock, [&] { return done_ || !tasks_.empty(); });
+      if (tasks_.empty()) return;
+      auto task = std::move(tasks_.front());
+      tasks_.pop_front();
+      lock.unlock();
+      task();
+      lock.lock();
+    }
+  }
+
+ public:
+  thread_executor() : worker_([this] { run(); }) {}
+  void add(std::function<void()> f) {
+    std::lock_guard lock(mutex_);
+    tasks_.push_back(std::move(f));
+    cvar_.notify_one();
+  }
+  ~thread_executor() {
+    {
+      std::lock_guard lock(mutex_);
+      done_ = true;
+    }
+    cvar_.notify_one();
+    worker_.join();
+  }
+};
+
+static void BM_ScanOrdersAsync(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  skydown::prepared_statement<
+      "SELECT id:integer, item:text, customerid:integer, price:real, "
+      "discount_code:text? FROM orders;"  //
+      >
+      select_orders{db.get()};
+  thread_executor executor;
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    double total = 0;
+    for (auto &row : select_orders.async_execute_rows(executor)) {
+      total += row["price"_col] + static_cast<double>(row["item"_col].size());
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// The same scan through the C API, without type checks.
+static void BM_ScanOrdersRaw(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db.get(),
+                     "SELECT id, item, customerid, price, discount_code FROM "
+                     "orders;",
+                     -1, &stmt, nullptr);
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    double total = 0;
+    sqlite3_reset(stmt);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      total += sqlite3_column_double(stmt, 3) + sqlite3_column_bytes(stmt, 1);
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  sqlite3_finalize(stmt);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+static void BM_FetchOrderColumns(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  skydown::prepared_statement<
+      "SELECT id:integer, item:text, customerid:integer, price:real "
+      "FROM orders;"  //
+      >
+      select_orders{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    auto columns = select_orders.execute_columns();
+    benchmark::DoNotOptimize(columns["price"_col].data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// What execute_columns replaces: transposing the rows by hand.
+static void BM_FetchOrderColumnsFromRows(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), state.range(0));
+  skydown::prepared_statement<
+      "SELECT id:integer, item:text, customerid:integer, price:real "
+      "FROM orders;"  //
+      >
+      select_orders{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    std::vector<std::int64_t> ids;
+    std::vector<std::string> items;
+    std::vector<std::int64_t> customer_ids;
+    std::vector<double> prices;
+    for (auto &row : select_orders.execute_rows()) {
+      ids.push_back(row["id"_col]);
+      items.emplace_back(row["item"_col]);
+      customer_ids.push_back(row["customerid"_col]);
+      prices.push_back(row["price"_col]);
+    }
+    benchmark::DoNotOptimize(prices.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+constexpr std::int64_t kReadRows = 100'000;
+
+constexpr skydown::sqlite_experimental::fixed_string select_price_sql =
+    "SELECT price:real FROM orders WHERE id = ?id:integer;";
+
+// Orders shared by the threads of the read benchmarks.
+orders_db &read_db() {
+  static orders_db db("tagged_sqlite_read_bm.db");
+  static bool filled = (fill_orders(db.get(), kReadRows), true);
+  (void)filled;
+  return db;
+}
+
+static void BM_PoolReads(benchmark::State &state) {
+  static skydown::connection_pool pool(
+      sqlite3_db_filename(read_db().get(), "main"), 32);
+  std::mt19937 gen(state.thread_index());
+  std::uniform_int_distribution<std::int64_t> id(1, kReadRows);
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    auto lease = pool.acquire();
+    lease.statement<select_price_sql>().execute_single_row_view(
+            [](auto &row) { benchmark::DoNotOptimize(row["price"_col]); },
+            "id"_param = id(gen));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// One connection behind a mutex, for comparison with BM_PoolReads.
+static void BM_SharedConnectionReads(benchmark::State &state) {
+  static std::mutex mutex;
+  static skydown::prepared_statement<select_price_sql> select{
+      read_db().get()};
+  std::mt19937 gen(state.thread_index());
+  std::uniform_int_distribution<std::int64_t> id(1, kReadRows);
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    std::lock_guard lock(mutex);
+    select.execute_single_row_view(
+        [](auto &row) { benchmark::DoNotOptimize(row["price"_col]); },
+        "id"_param = id(gen));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+using customer_row = decltype(skydown::sqlite_experimental::tagged_tuple{
+    "id"_param = std::int64_t{}, "name"_param = std::string_view{}});
+
+std::vector<customer_row> make_customers(std::int64_t count) {
+  std::vector<customer_row> customers;
+  customers.reserve(count);
+  for (std::int64_t i = 0; i < count; ++i) {
+    customers.push_back(customer_row{"id"_param = i,
+                                     "name"_param = std::string_view("John")});
+  }
+  return customers;
+}
+
+// Joins 1000 orders with customers held in memory.
+static void BM_SpanTableJoin(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), 1000);
+  auto customers = make_customers(state.range(0));
+  skydown::register_span_table(db.get(), "customers",
+                               std::span<const customer_row>(customers));
+  skydown::prepared_statement<
+      "SELECT price:real, name:text FROM orders "
+      "JOIN customers ON customers.id = customerid;"  //
+      >
+      select_orders{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    double total = 0;
+    for (auto &row : select_orders.execute_rows()) {
+      total += row["price"_col];
+    }
+    benchmark::DoNotOptimize(total);
+  }
+}
+
+// The same join after copying the customers into a table.
+static void BM_StagedTableJoin(benchmark::State &state) {
+  orders_db db;
+  fill_orders(db.get(), 1000);
+  auto customers = make_customers(state.range(0));
+  skydown::prepared_statement<
+      "CREATE TEMP TABLE customers(id INTEGER NOT NULL PRIMARY KEY, "
+      "name TEXT NOT NULL);"  //
+      >{db.get()}
+      .execute();
+  skydown::prepared_statement<
+      "SELECT price:real, name:text FROM orders "
+      "JOIN customers ON customers.id = customerid;"  //
+      >
+      select_orders{db.get()};
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    skydown::prepared_statement<"DELETE FROM customers;">{db.get()}.execute();
+    skydown::prepared_statement<
+        "INSERT INTO customers(id, name) VALUES(?id:integer, ?name:text);">{
+        db.get()}
+        .execute_many(customers);
+    double total = 0;
+    for (auto &row : select_orders.execute_rows()) {
+      total += row["price"_col];
+    }
+    benchmark::DoNotOptimize(total);
+  }
+}
+
+// Per execute overhead with text parameters, with a statement that returns no
+// rows, so that stepping costs little.
+static void BM_ExecuteBind(benchmark::State &state) {
+  orders_db db;
+  skydown::prepared_statement<
+      "SELECT 1 WHERE ?item:text IS NULL AND ?customerid:integer IS NULL AND "
+      "?price:real IS NULL AND ?discount_code:text? IS NULL;"  //
+      >
+      statement{db.get()};
+  std::string item = "A phone with a name too long for small strings";
+  std::optional<std::string> discount_code = "BIGSALE";
+  std::int64_t i = 0;
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    statement.execute("item"_param = item, "customerid"_param = ++i,
+                      "price"_param = 1444.44,
+                      "discount_code"_param = discount_code);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// The same through the C API.
+static void BM_ExecuteBindRaw(benchmark::State &state) {
+  orders_db db;
+  sqlite3_stmt *stmt;
+  sqlite3_prepare_v2(db.get(),
+                     "SELECT 1 WHERE ? IS NULL AND ? IS NULL AND ? IS NULL AND "
+                     "? IS NULL;",
+                     -1, &stmt, nullptr);
+  std::string item = "A phone with a name too long for small strings";
+  std::optional<std::string> discount_code = "BIGSALE";
+  std::int64_t i = 0;
+  // Perform setup here
+  for (auto _ : state) {
+    // This code gets timed
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    sqlite3_bind_text(stmt, 1, item.data(), static_cast<int>(item.size()),
+                      SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, ++i);
+    sqlite3_bind_double(stmt, 3, 1444.44);
+    sqlite3_bind_text(stmt, 4, discount_code->data(),
+                      static_cast<int>(discount_code->size()), SQLITE_STATIC);
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+  }
+  sqlite3_finalize(stmt);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Every autocommit insert syncs the file, so it gets fewer rows.
+BENCHMARK(BM_InsertOrdersAutocommit)->Arg(1000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_InsertOrdersExecuteMany)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_InsertOrdersBatchWriter)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK(BM_ScanOrders)
+    ->Arg(1'000'000)
+    ->Arg(10'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ScanOrdersAsync)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_ProcessOrders)
+    ->Arg(10'000'000)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_ProcessOrdersBuffered)
+    ->Args({10'000'000, 0})
+    ->Args({10'000'000, 1})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+BENCHMARK(BM_ScanOrdersRaw)
+    ->Arg(1'000'000)
+    ->Arg(10'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FetchOrderColumns)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_FetchOrderColumnsFromRows)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_PoolReads)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK(BM_SharedConnectionReads)->ThreadRange(1, 32)->UseRealTime();
+BENCHMARK(BM_SpanTableJoin)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_StagedTableJoin)
+    ->Arg(1'000'000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_ExecuteBind);
+BENCHMARK(BM_ExecuteBindRaw);
+BENCHMARK(BM_InsertLongText);
+BENCHMARK(BM_InsertLongTextTransient);
+
+BENCHMARK_MAIN();
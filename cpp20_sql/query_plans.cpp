@@ -0,0 +1,85 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Checks the plans of the queries of this program against synthetic data, and
+// fails if one of them scans a large table. Removing the index on customerid
+// makes it fail.
+
+#include "tagged_sqlite.h"
+
+using namespace skydown::literals;
+
+void create_tables(sqlite3 *sqldb) {
+  skydown::prepared_statement<
+      "CREATE TABLE customers("
+      "id INTEGER NOT NULL PRIMARY KEY, "
+      "name TEXT NOT NULL"
+      ");"  //
+      >{sqldb}
+      .execute();
+
+  skydown::prepared_statement<
+      "CREATE TABLE orders("
+      "id INTEGER NOT NULL PRIMARY KEY,"
+      "item TEXT NOT NULL, "
+      "customerid INTEGER NOT NULL,"
+      "price REAL NOT NULL, "
+      "discount_code TEXT "
+      ");"  //
+      >{sqldb}
+      .execute();
+
+  skydown::prepared_statement<
+      "CREATE INDEX orders_customerid ON orders(customerid);"  //
+      >{sqldb}
+      .execute();
+}
+
+// The queries are only instantiated, which is enough to register them.
+void queries(sqlite3 *sqldb) {
+  skydown::prepared_statement<
+      "select id:integer from customers "
+      "where name = ?name:text;"  //
+      >
+      select_customer{sqldb};
+
+  skydown::prepared_statement<
+      "SELECT item:text, price:real FROM orders "
+      "WHERE customerid = ?customerid:integer;"  //
+      >
+      select_orders{sqldb};
+
+  skydown::prepared_statement<
+      "SELECT orders.id:integer, name:text, item:text, price:real, "
+      "discount_code:text? "
+      "FROM orders JOIN customers ON customers.id = customerid "
+      "WHERE customerid = ?customerid:integer;">
+      select_customer_orders{sqldb};
+}
+
+int main() {
+  sqlite3 *sqldb;
+  sqlite3_open(":memory:", &sqldb);
+  create_tables(sqldb);
+  skydown::fill_synthetic_rows(sqldb, "customers", 1'000);
+  skydown::fill_synthetic_rows(sqldb, "orders", 100'000);
+
+  skydown::query_plan_options options;
+  options.min_scan_rows = 10'000;
+  auto plans = skydown::explain_queries(sqldb, options);
+  auto flagged = skydown::print_query_plans(std::cout, plans);
+
+  sqlite3_close(sqldb);
+  return flagged == 0 ? 0 : 1;
+}
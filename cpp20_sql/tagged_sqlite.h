@@ -15,16 +15,33 @@
 #include <assert.h>
 #include <sqlite3.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <compare>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace skydown {
 
@@ -86,6 +103,21 @@ inline bool read_row_into(sqlite3_stmt *stmt, int index, std::string_view &v) {
   }
 }
 
+// The span points into the buffer of sqlite, which is valid until the next
+// step.
+inline bool read_row_into(sqlite3_stmt *stmt, int index,
+                          std::span<const std::byte> &v) {
+  auto type = sqlite3_column_type(stmt, index);
+  if (type == SQLITE_BLOB) {
+    auto ptr = static_cast<const std::byte *>(sqlite3_column_blob(stmt, index));
+    auto size = sqlite3_column_bytes(stmt, index);
+    v = std::span<const std::byte>(ptr, ptr ? size : 0);
+    return true;
+  } else {
+    return false;
+  }
+}
+
 template <typename T>
 inline bool read_row_into(sqlite3_stmt *stmt, int index, std::optional<T> &v) {
   auto type = sqlite3_column_type(stmt, index);
@@ -117,13 +149,172 @@ auto read_row(sqlite3_stmt *stmt) {
   return row;
 }
 
+// Reads that skip sqlite3_column_type in release builds. They are only used
+// for columns that cannot hold another type, and NULL is read as 0 or an
+// empty string, the same value the checked reads leave in a default
+// constructed row. Debug builds assert that no other type is converted.
+inline bool is_column_type(sqlite3_stmt *stmt, int index, int type) {
+  auto t = sqlite3_column_type(stmt, index);
+  return t == type || t == SQLITE_NULL;
+}
+
+inline void read_row_into_unchecked(sqlite3_stmt *stmt, int index,
+                                    std::int64_t &v) {
+  assert(is_column_type(stmt, index, SQLITE_INTEGER));
+  v = sqlite3_column_int64(stmt, index);
+}
+
+inline void read_row_into_unchecked(sqlite3_stmt *stmt, int index, double &v) {
+  assert(is_column_type(stmt, index, SQLITE_FLOAT));
+  v = sqlite3_column_double(stmt, index);
+}
+
+inline void read_row_into_unchecked(sqlite3_stmt *stmt, int index,
+                                    std::string_view &v) {
+  assert(is_column_type(stmt, index, SQLITE_TEXT));
+  const char *ptr =
+      reinterpret_cast<const char *>(sqlite3_column_text(stmt, index));
+  auto size = sqlite3_column_bytes(stmt, index);
+  v = std::string_view(ptr, ptr ? size : 0);
+}
+
+inline void read_row_into_unchecked(sqlite3_stmt *stmt, int index,
+                                    std::span<const std::byte> &v) {
+  assert(is_column_type(stmt, index, SQLITE_BLOB));
+  auto ptr = static_cast<const std::byte *>(sqlite3_column_blob(stmt, index));
+  auto size = sqlite3_column_bytes(stmt, index);
+  v = std::span<const std::byte>(ptr, ptr ? size : 0);
+}
+
+// Whether the declared type of the column has the affinity of T, using the
+// rules of https://www.sqlite.org/datatype3.html. Expressions have no
+// declared type.
+template <typename T>
+bool has_declared_type(sqlite3_stmt *stmt, int index) {
+  const char *decl = sqlite3_column_decltype(stmt, index);
+  if (!decl) return false;
+  std::string type(decl);
+  std::transform(type.begin(), type.end(), type.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  auto has = [&](std::string_view s) { return type.find(s) != type.npos; };
+  if (has("INT")) return std::is_same_v<T, std::int64_t>;
+  if (has("CHAR") || has("CLOB") || has("TEXT")) {
+    return std::is_same_v<T, std::string_view>;
+  }
+  if (has("BLOB")) return std::is_same_v<T, std::span<const std::byte>>;
+  if (has("REAL") || has("FLOA") || has("DOUB")) {
+    return std::is_same_v<T, double>;
+  }
+  return false;
+}
+
+#ifdef TAGGED_SQLITE_COLUMN_METADATA
+// Whether table is a STRICT table, whose typed columns only hold values of
+// their type. SQLite before 3.37 has no pragma_table_list and no STRICT
+// tables.
+inline bool is_strict_table(sqlite3 *sqldb, const char *schema,
+                            const char *table) {
+  sqlite3_stmt *stmt = nullptr;
+  auto r = sqlite3_prepare_v2(
+      sqldb,
+      "SELECT strict FROM pragma_table_list WHERE schema = ? AND name = ?;",
+      -1, &stmt, nullptr);
+  if (r != SQLITE_OK) return false;
+  sqlite3_bind_text(stmt, 1, schema, -1, SQLITE_STATIC);
+  sqlite3_bind_text(stmt, 2, table, -1, SQLITE_STATIC);
+  bool strict = sqlite3_step(stmt) == SQLITE_ROW &&
+                sqlite3_column_int(stmt, 0) != 0;
+  sqlite3_finalize(stmt);
+  return strict;
+}
+#endif
+
+// Whether the column is read directly from a NOT NULL column of a STRICT
+// table, so that its values have the declared type or are NULL from an outer
+// join. Finding the column needs SQLite built with
+// SQLITE_ENABLE_COLUMN_METADATA, which is not the default. Define
+// TAGGED_SQLITE_COLUMN_METADATA when it is, otherwise no column qualifies.
+inline bool is_strict_not_null_column(sqlite3_stmt *stmt, int index) {
+#ifdef TAGGED_SQLITE_COLUMN_METADATA
+  auto schema = sqlite3_column_database_name(stmt, index);
+  auto table = sqlite3_column_table_name(stmt, index);
+  auto column = sqlite3_column_origin_name(stmt, index);
+  if (!schema || !table || !column) return false;
+  auto sqldb = sqlite3_db_handle(stmt);
+  int not_null = 0;
+  auto r = sqlite3_table_column_metadata(sqldb, schema, table, column, nullptr,
+                                         nullptr, &not_null, nullptr, nullptr);
+  return r == SQLITE_OK && not_null && is_strict_table(sqldb, schema, table);
+#else
+  (void)stmt;
+  (void)index;
+  return false;
+#endif
+}
+
+template <typename T>
+std::true_type is_optional(const std::optional<T> &);
+
+std::false_type is_optional(...);
+
+// Checks the columns of a statement once, so that rows can be read without
+// per value type checks. Non-optional columns that come from a NOT NULL
+// column of a STRICT table, with the matching declared type, use the
+// unchecked reads. prepared_statement keeps the reader of its statement.
+template <typename RowType>
+class row_reader {
+  static constexpr std::size_t size = tuple_size(RowType{});
+  std::array<bool, size> unchecked_ = {};
+
+ public:
+  explicit row_reader(sqlite3_stmt *stmt) {
+    std::size_t count = sqlite3_column_count(stmt);
+    assert(size == count);
+    if (size != count) {
+      throw std::runtime_error(
+          "sqlite error: mismatch between read_row and sql columns");
+    }
+    int index = 0;
+    RowType row = {};
+    for_each(row, [&](auto &m) mutable {
+      using value_type = std::decay_t<decltype(m.value)>;
+      if constexpr (!decltype(is_optional(m.value))::value) {
+        unchecked_[index] = has_declared_type<value_type>(stmt, index) &&
+                            is_strict_not_null_column(stmt, index);
+      }
+      ++index;
+    });
+  }
+
+  void read(sqlite3_stmt *stmt, RowType &row) const {
+    int index = 0;
+    for_each(row, [&](auto &m) mutable {
+      if constexpr (decltype(is_optional(m.value))::value) {
+        read_row_into(stmt, index, m.value);
+      } else if (unchecked_[index]) {
+        read_row_into_unchecked(stmt, index, m.value);
+      } else {
+        m.value = {};
+        read_row_into(stmt, index, m.value);
+      }
+      ++index;
+    });
+  }
+};
+
+// The row is read the first time it is dereferenced after each step.
 template <typename RowType>
 struct row_range {
   RowType row;
   int last_result = 0;
   sqlite3_stmt *stmt;
+  row_reader<RowType> reader;
+  bool row_read = false;
 
-  row_range(sqlite3_stmt *stmt) : stmt(stmt) { next(); }
+  row_range(sqlite3_stmt *stmt, row_reader<RowType> reader)
+      : stmt(stmt), reader(reader) {
+    next();
+  }
 
   struct end_type {};
 
@@ -131,6 +322,7 @@ struct row_range {
 
   void next() {
     last_result = sqlite3_step(stmt);
+    row_read = false;
     check_sqlite_return(last_result, SQLITE_DONE, SQLITE_ROW);
   }
 
@@ -146,7 +338,10 @@ struct row_range {
     bool operator==(end_type) { return p->last_result != SQLITE_ROW; }
 
     RowType &operator*() {
-      p->row = read_row<RowType>(p->stmt);
+      if (!p->row_read) {
+        p->reader.read(p->stmt, p->row);
+        p->row_read = true;
+      }
       return p->row;
     }
   };
@@ -158,26 +353,40 @@ struct row_range {
   row_iterator begin() { return {this}; }
 };
 
-inline bool bind_impl(sqlite3_stmt *stmt, int index, double v) {
+inline bool bind_impl(sqlite3_stmt *stmt, int index, double v,
+                      sqlite3_destructor_type) {
   auto r = sqlite3_bind_double(stmt, index, v);
   return r == SQLITE_OK;
 }
 
-inline bool bind_impl(sqlite3_stmt *stmt, int index, std::int64_t v) {
+inline bool bind_impl(sqlite3_stmt *stmt, int index, std::int64_t v,
+                      sqlite3_destructor_type) {
   auto r = sqlite3_bind_int64(stmt, index, v);
   return r == SQLITE_OK;
 }
 
-inline bool bind_impl(sqlite3_stmt *stmt, int index, std::string_view v) {
+inline bool bind_impl(sqlite3_stmt *stmt, int index, std::string_view v,
+                      sqlite3_destructor_type text_lifetime) {
   auto r = sqlite3_bind_text(stmt, index, v.data(), static_cast<int>(v.size()),
-                             SQLITE_TRANSIENT);
+                             text_lifetime);
+  return r == SQLITE_OK;
+}
+
+inline bool bind_impl(sqlite3_stmt *stmt, int index,
+                      std::span<const std::byte> v,
+                      sqlite3_destructor_type lifetime) {
+  // A null pointer would bind NULL instead of an empty blob.
+  auto r = v.data() ? sqlite3_bind_blob64(stmt, index, v.data(), v.size(),
+                                          lifetime)
+                    : sqlite3_bind_zeroblob(stmt, index, 0);
   return r == SQLITE_OK;
 }
 
 template <typename T>
-bool bind_impl(sqlite3_stmt *stmt, int index, const std::optional<T> &v) {
+bool bind_impl(sqlite3_stmt *stmt, int index, const std::optional<T> &v,
+               sqlite3_destructor_type text_lifetime) {
   if (v.has_value()) {
-    return bind_impl(stmt, index, *v);
+    return bind_impl(stmt, index, *v, text_lifetime);
   } else {
     auto r = sqlite3_bind_null(stmt, index);
     return r == SQLITE_OK;
@@ -259,9 +468,12 @@ void for_each(tagged_tuple<Members...> &m, F f) {
   (f(static_cast<Members &>(m)), ...);
 }
 
-auto to_concrete(const std::string_view &v) { return std::string(v); }
-auto to_concrete(std::int64_t i) { return i; }
-auto to_concrete(double d) { return d; }
+inline auto to_concrete(const std::string_view &v) { return std::string(v); }
+inline auto to_concrete(std::int64_t i) { return i; }
+inline auto to_concrete(double d) { return d; }
+inline auto to_concrete(std::span<const std::byte> b) {
+  return std::vector<std::byte>(b.begin(), b.end());
+}
 template <typename T>
 auto to_concrete(const std::optional<T> &o)
     -> std::optional<decltype(to_concrete(std::declval<T>()))> {
@@ -292,8 +504,374 @@ auto to_concrete(tagged_tuple<member<Tags, Ts>...> &&t) {
   return tagged_tuple { make_member<Tags>(to_concrete(get<Tags>(std::move(t))))... };
 }
 
+// A column of text stored in one buffer, as returned by execute_columns.
+class text_column {
+  std::string data_;
+  std::vector<std::size_t> ends_;
+
+ public:
+  std::size_t size() const { return ends_.size(); }
+  bool empty() const { return ends_.empty(); }
+
+  std::string_view operator[](std::size_t i) const {
+    std::size_t begin = i == 0 ? 0 : ends_[i - 1];
+    return std::string_view(data_).substr(begin, ends_[i] - begin);
+  }
+
+  // The text of all rows, concatenated. Row i ends at ends()[i].
+  std::string_view data() const { return data_; }
+  const std::vector<std::size_t> &ends() const { return ends_; }
+
+  void push_back(std::string_view s) {
+    data_.append(s);
+    ends_.push_back(data_.size());
+  }
+
+  void reserve(std::size_t rows) { ends_.reserve(rows); }
+};
+
+// Like text_column, for blobs.
+class blob_column {
+  std::vector<std::byte> data_;
+  std::vector<std::size_t> ends_;
+
+ public:
+  std::size_t size() const { return ends_.size(); }
+  bool empty() const { return ends_.empty(); }
+
+  std::span<const std::byte> operator[](std::size_t i) const {
+    std::size_t begin = i == 0 ? 0 : ends_[i - 1];
+    return std::span<const std::byte>(data_).subspan(begin,
+                                                     ends_[i] - begin);
+  }
+
+  std::span<const std::byte> data() const { return data_; }
+  const std::vector<std::size_t> &ends() const { return ends_; }
+
+  void push_back(std::span<const std::byte> b) {
+    data_.insert(data_.end(), b.begin(), b.end());
+    ends_.push_back(data_.size());
+  }
+
+  void reserve(std::size_t rows) { ends_.reserve(rows); }
+};
+
+// A column of T where NULL is stored as a default constructed value.
+template <typename Column>
+struct nullable_column {
+  Column values;
+  std::vector<bool> has_value;
+
+  std::size_t size() const { return has_value.size(); }
+  bool empty() const { return has_value.empty(); }
+
+  auto operator[](std::size_t i) const
+      -> std::optional<std::decay_t<decltype(values[i])>> {
+    if (!has_value[i]) return std::nullopt;
+    return values[i];
+  }
+
+  template <typename T>
+  void push_back(const std::optional<T> &v) {
+    values.push_back(v ? *v : T{});
+    has_value.push_back(v.has_value());
+  }
+
+  void reserve(std::size_t rows) {
+    values.reserve(rows);
+    has_value.reserve(rows);
+  }
+};
+
+std::vector<std::int64_t> column_for(std::int64_t);
+std::vector<double> column_for(double);
+text_column column_for(std::string_view);
+blob_column column_for(std::span<const std::byte>);
+template <typename T>
+nullable_column<decltype(column_for(std::declval<T>()))> column_for(
+    std::optional<T>);
+
+template <typename... Tags, typename... Ts>
+auto columns_for(const tagged_tuple<member<Tags, Ts>...> &)
+    -> tagged_tuple<member<Tags, decltype(column_for(std::declval<Ts>()))>...>;
+
+// Like dst = to_concrete(src), but reuses the memory of the strings in dst.
+inline void assign_concrete(std::string &dst, std::string_view src) {
+  dst.assign(src);
+}
+inline void assign_concrete(std::int64_t &dst, std::int64_t src) { dst = src; }
+inline void assign_concrete(double &dst, double src) { dst = src; }
+inline void assign_concrete(std::vector<std::byte> &dst,
+                            std::span<const std::byte> src) {
+  dst.assign(src.begin(), src.end());
+}
+template <typename D, typename S>
+void assign_concrete(std::optional<D> &dst, const std::optional<S> &src) {
+  if (!src) {
+    dst.reset();
+  } else {
+    if (!dst) dst.emplace();
+    assign_concrete(*dst, *src);
+  }
+}
+template <typename... Members, typename Src>
+void assign_concrete(tagged_tuple<Members...> &dst, const Src &src) {
+  for_each(dst, [&](auto &m) {
+    using tag = typename std::decay_t<decltype(m)>::tag_type;
+    assign_concrete(m.value, get<tag>(src));
+  });
+}
+
+// Rows passed from a thread stepping a statement to the thread reading them.
+// The producer waits while capacity rows are queued. Rows are queued in chunks
+// to make synchronization less frequent.
+template <typename Row>
+class row_channel_state {
+  std::mutex mutex_;
+  std::condition_variable cvar_;
+  std::deque<std::vector<Row>> chunks_;
+  std::size_t queued_ = 0;
+  std::size_t capacity_;
+  bool started_ = false;
+  bool done_ = false;
+  bool cancelled_ = false;
+  std::exception_ptr eptr_;
+
+ public:
+  explicit row_channel_state(std::size_t capacity)
+      : capacity_(std::max<std::size_t>(capacity, 1)) {}
+
+  std::size_t chunk_size() const {
+    return std::max<std::size_t>(capacity_ / 4, 1);
+  }
+
+  // Called by the producer before it uses the statement. Returns false if the
+  // reader is already gone, and the producer must not use it.
+  bool start() {
+    std::lock_guard lock(mutex_);
+    started_ = !cancelled_;
+    return started_;
+  }
+
+  // Returns false if the reader is gone.
+  bool push(std::vector<Row> chunk) {
+    std::unique_lock lock(mutex_);
+    cvar_.wait(lock, [&] { return cancelled_ || queued_ < capacity_; });
+    if (cancelled_) return false;
+    queued_ += chunk.size();
+    chunks_.push_back(std::move(chunk));
+    cvar_.notify_all();
+    return true;
+  }
+
+  void close(std::exception_ptr eptr) {
+    std::lock_guard lock(mutex_);
+    done_ = true;
+    eptr_ = eptr;
+    cvar_.notify_all();
+  }
+
+  // Returns an empty chunk once all rows were read, or rethrows the error of
+  // the producer.
+  std::vector<Row> pop() {
+    std::unique_lock lock(mutex_);
+    cvar_.wait(lock, [&] { return done_ || !chunks_.empty(); });
+    if (chunks_.empty()) {
+      if (eptr_) std::rethrow_exception(eptr_);
+      return {};
+    }
+    auto chunk = std::move(chunks_.front());
+    chunks_.pop_front();
+    queued_ -= chunk.size();
+    cvar_.notify_all();
+    return chunk;
+  }
+
+  // Stops the producer and waits for it to be done with the statement. A
+  // producer that has not started yet never uses it, and is not waited for.
+  void cancel() {
+    std::unique_lock lock(mutex_);
+    cancelled_ = true;
+    cvar_.notify_all();
+    cvar_.wait(lock, [&] { return done_ || !started_; });
+  }
+};
+
+// The rows of async_execute_rows. Like row_range, it is an input range, but
+// the rows are copies that stay valid. Destroying the channel stops the scan
+// and waits for it.
+template <typename Row>
+class row_channel {
+  std::shared_ptr<row_channel_state<Row>> state_;
+  std::vector<Row> chunk_;
+  std::size_t index_ = 0;
+
+  void next() {
+    if (++index_ < chunk_.size()) return;
+    chunk_ = state_->pop();
+    index_ = 0;
+  }
+
+ public:
+  explicit row_channel(std::shared_ptr<row_channel_state<Row>> state)
+      : state_(std::move(state)) {}
+  row_channel(row_channel &&) = default;
+  row_channel &operator=(row_channel &&) = delete;
+
+  ~row_channel() {
+    if (state_) state_->cancel();
+  }
+
+  struct end_type {};
+
+  end_type end() { return {}; }
+
+  struct row_iterator {
+    row_channel *p;
+
+    row_iterator &operator++() {
+      p->next();
+      return *this;
+    }
+
+    bool operator!=(end_type) { return p->index_ < p->chunk_.size(); }
+    bool operator==(end_type) { return p->index_ >= p->chunk_.size(); }
+
+    Row &operator*() { return p->chunk_[p->index_]; }
+  };
+
+  row_iterator begin() {
+    chunk_ = state_->pop();
+    index_ = 0;
+    return {this};
+  }
+};
+
+// Steps stmt and pushes copies of its rows into state until the reader is
+// gone, then resets stmt. Does nothing if the reader was gone before.
+template <typename RowType, typename Row>
+void produce_rows(sqlite3_stmt *stmt, row_reader<RowType> reader,
+                  row_channel_state<Row> &state) {
+  if (!state.start()) return;
+  try {
+    std::vector<Row> chunk;
+    chunk.reserve(state.chunk_size());
+    for (auto &row : row_range<RowType>(stmt, reader)) {
+      chunk.push_back(to_concrete(row));
+      if (chunk.size() == state.chunk_size()) {
+        if (!state.push(std::move(chunk))) break;
+        chunk = {};
+        chunk.reserve(state.chunk_size());
+      }
+    }
+    if (!chunk.empty()) state.push(std::move(chunk));
+    sqlite3_reset(stmt);
+    state.close(nullptr);
+  } catch (...) {
+    sqlite3_reset(stmt);
+    state.close(std::current_exception());
+  }
+}
+
+struct row_buffering {
+  // How many rows are decoded ahead of the reader.
+  std::size_t rows = 256;
+  // Whether a thread of the range steps the statement, so that the reader
+  // and sqlite run at the same time.
+  bool helper_thread = false;
+};
+
+// Like row_range, but rows are decoded into copies, buffering.rows at a time,
+// either when the reader runs out of them or on a helper thread.
+template <typename RowType>
+class buffered_row_range {
+  using Row = decltype(to_concrete(std::declval<RowType>()));
+
+  sqlite3_stmt *stmt_;
+  row_reader<RowType> reader_;
+  RowType row_;
+  std::shared_ptr<row_channel_state<Row>> state_;
+  std::thread helper_;
+  std::vector<Row> buffer_;
+  std::size_t size_ = 0;
+  std::size_t index_ = 0;
+  bool done_ = false;
+
+  void fill() {
+    index_ = 0;
+    if (state_) {
+      buffer_ = state_->pop();
+      size_ = buffer_.size();
+      return;
+    }
+    size_ = 0;
+    while (!done_ && size_ < buffer_.size()) {
+      auto r = sqlite3_step(stmt_);
+      check_sqlite_return(r, SQLITE_DONE, SQLITE_ROW);
+      if (r == SQLITE_DONE) {
+        done_ = true;
+      } else {
+        reader_.read(stmt_, row_);
+        assign_concrete(buffer_[size_++], row_);
+      }
+    }
+  }
+
+  void next() {
+    if (++index_ == size_) fill();
+  }
+
+ public:
+  buffered_row_range(sqlite3_stmt *stmt, row_reader<RowType> reader,
+                     row_buffering buffering)
+      : stmt_(stmt), reader_(reader) {
+    auto rows = std::max<std::size_t>(buffering.rows, 1);
+    if (buffering.helper_thread) {
+      state_ = std::make_shared<row_channel_state<Row>>(rows);
+      helper_ = std::thread([state = state_, stmt, reader] {
+        produce_rows<RowType>(stmt, reader, *state);
+      });
+    } else {
+      buffer_.resize(rows);
+    }
+  }
+  buffered_row_range(const buffered_row_range &) = delete;
+  buffered_row_range &operator=(const buffered_row_range &) = delete;
+
+  ~buffered_row_range() {
+    if (state_) {
+      state_->cancel();
+      helper_.join();
+    }
+  }
+
+  struct end_type {};
+
+  end_type end() { return {}; }
+
+  struct row_iterator {
+    buffered_row_range *p;
+
+    row_iterator &operator++() {
+      p->next();
+      return *this;
+    }
+
+    bool operator!=(end_type) { return p->index_ < p->size_; }
+    bool operator==(end_type) { return p->index_ >= p->size_; }
+
+    Row &operator*() { return p->buffer_[p->index_]; }
+  };
+
+  row_iterator begin() {
+    fill();
+    return {this};
+  }
+};
+
 template <std::size_t N>
 struct fixed_string {
+  constexpr fixed_string() = default;
   constexpr fixed_string(const char (&foo)[N + 1]) {
     std::copy_n(foo, N + 1, data);
   }
@@ -346,6 +924,11 @@ struct string_to_type<compile_string<"real">> {
   using type = double;
 };
 
+template <>
+struct string_to_type<compile_string<"blob">> {
+  using type = std::span<const std::byte>;
+};
+
 template <typename T>
 using string_to_type_t = typename string_to_type<T>::type;
 
@@ -503,56 +1086,101 @@ constexpr auto make_parameters() {
       std::make_index_sequence<ts.size()>());
 }
 
-// todo make constexpr
-template <std::size_t N>
-inline std::string get_sql_string(std::string_view sv, type_specs<N> specs) {
-  std::string ret;
-  ret.reserve(sv.size());
+// Calls f with the pieces of the SQL that sqlite sees, with the types
+// removed from the type specs and the names removed from the parameters.
+template <std::size_t N, typename F>
+constexpr void for_each_sql_piece(std::string_view sv,
+                                  const type_specs<N> &specs, F f) {
   std::size_t prev_i = 0;
-  for (type_spec &ts : specs.data) {
-    ret += std::string(sv.substr(prev_i, ts.name.first - prev_i));
-    [[maybe_unused]] std::string_view name =
-        sv.substr(ts.name.first, ts.name.second);
-    [[maybe_unused]] std::string_view type =
-        sv.substr(ts.type.first, ts.type.second);
+  for (std::size_t i = 0; i < N; ++i) {
+    const type_spec &ts = specs[i];
+    f(sv.substr(prev_i, ts.name.first - prev_i));
     if (sv[ts.name.first] == '?') {
-      ret += '?';
+      f("?");
     } else {
-      ret += std::string(sv.substr(ts.name.first, ts.name.second));
+      f(sv.substr(ts.name.first, ts.name.second));
     }
-    ret += " ";
+    f(" ");
     prev_i = ts.type.first + ts.type.second;
     if (ts.optional) ++prev_i;
   }
+  f(sv.substr(prev_i));
+}
 
-  ret += std::string(sv.substr(prev_i));
-
+template <fixed_string query_string>
+constexpr auto make_sql_string() {
+  constexpr auto specs = parse_type_specs<query_string, true, true>();
+  constexpr std::size_t size = [&] {
+    std::size_t n = 0;
+    for_each_sql_piece(query_string.sv(), specs,
+                       [&](std::string_view piece) { n += piece.size(); });
+    return n;
+  }();
+  fixed_string<size> ret;
+  std::size_t pos = 0;
+  for_each_sql_piece(query_string.sv(), specs, [&](std::string_view piece) {
+    std::copy_n(piece.data(), piece.size(), ret.data + pos);
+    pos += piece.size();
+  });
   return ret;
 }
 
-template <typename T>
-std::true_type is_optional(const std::optional<T> &);
+// The SQL for a query, computed at compile time. data is null terminated.
+template <fixed_string query_string>
+inline constexpr auto sql_string = make_sql_string<query_string>();
 
-std::false_type is_optional(...);
+// The 1 based index of the parameter with Tag, or 0 if there is none.
+template <typename Tag, typename... Members>
+constexpr int parameter_index(const tagged_tuple<Members...> *) {
+  int index = 0;
+  int i = 0;
+  ((++i, index = std::is_same_v<Tag, typename Members::tag_type> ? i : index),
+   ...);
+  return index;
+}
 
-template <typename PTuple, typename ATuple>
-void do_binding(sqlite3_stmt *stmt, PTuple p_tuple, ATuple a_tuple) {
-  int index = 1;
-  skydown::sqlite_experimental::for_each(p_tuple, [&](auto &m) mutable {
-    using m_t = std::decay_t<decltype(m)>;
-    using tag = typename m_t::tag_type;
-    m.value = [&]() -> m_t::value_type {
-      if constexpr (decltype(is_optional(m.value))::value &&
-                    !decltype(has_tag<tag>(a_tuple))::value) {
-        return std::nullopt;
-      } else {
-        return std::move(get<tag>(a_tuple));
-      }
-    }();
-    auto r = bind_impl(stmt, index, m.value);
+template <typename Tag, typename... Args>
+constexpr bool has_argument = (std::is_same_v<Tag, typename Args::tag_type> ||
+                               ...);
+
+template <typename... Members, typename... Args>
+constexpr bool has_required_parameters(const tagged_tuple<Members...> *,
+                                       const Args *...) {
+  return ((decltype(is_optional(
+               std::declval<typename Members::value_type>()))::value ||
+           has_argument<typename Members::tag_type, Args...>) &&
+          ...);
+}
+
+// Binds each argument to the parameter with its tag, converted to the type of
+// the parameter, which does not copy strings. The statement must have no
+// bindings, so that missing optional parameters are NULL. With SQLITE_STATIC,
+// the arguments must outlive the use of the bindings.
+template <typename PTuple, typename... Args>
+void bind_parameters(sqlite3_stmt *stmt, sqlite3_destructor_type lifetime,
+                     const Args &... args) {
+  static_assert(has_required_parameters(static_cast<const PTuple *>(nullptr),
+                                        static_cast<const Args *>(nullptr)...),
+                "missing a parameter that is not optional");
+  auto bind = [&](const auto &arg) {
+    using tag = typename std::decay_t<decltype(arg)>::tag_type;
+    constexpr int index =
+        parameter_index<tag>(static_cast<const PTuple *>(nullptr));
+    static_assert(index != 0, "not a parameter of the query");
+    using value_type = typename std::decay_t<decltype(
+        get<tag>(std::declval<PTuple &>()))>;
+    const value_type value = arg.value;
+    auto r = bind_impl(stmt, index, value, lifetime);
     check_sqlite_return<bool>(r, true);
-    ++index;
-  });
+  };
+  (bind(args), ...);
+  (void)bind;
+}
+
+template <typename PTuple, typename... Members>
+void bind_tuple(sqlite3_stmt *stmt, sqlite3_destructor_type lifetime,
+                const tagged_tuple<Members...> &t) {
+  bind_parameters<PTuple>(stmt, lifetime, static_cast<const Members &>(t)...);
 }
 
 struct stmt_closer {
@@ -563,62 +1191,1335 @@ struct stmt_closer {
 
 using unique_stmt = std::unique_ptr<sqlite3_stmt, stmt_closer>;
 
+inline std::size_t next_statement_id() {
+  static std::atomic<std::size_t> id = 0;
+  return id++;
+}
+
+// Index of the slot for Query in every statement_cache.
 template <fixed_string Query>
-class prepared_statement {
-  using RowType = decltype(make_members<Query>());
-  using PTuple = decltype(make_parameters<Query>());
+inline const std::size_t statement_id = next_statement_id();
+
+// Prepared statements of one connection, with one slot for each Query.
+// Caching is off until statement_cache::enable is called for the connection.
+// Then a prepared_statement takes the statement out of its slot, and puts it
+// back reset when it is destroyed. Call statement_cache::clear after
+// destroying the prepared statements of the connection and before closing it,
+// as sqlite3_close fails while statements are not finalized. Without enable,
+// statements are finalized when the prepared_statement is destroyed.
+class statement_cache {
+  std::vector<unique_stmt> slots_;
+  std::size_t hits_ = 0;
+  std::size_t misses_ = 0;
+
+  struct registry {
+    std::mutex mutex;
+    std::unordered_map<sqlite3 *, statement_cache> caches;
+  };
 
-  unique_stmt stmt_;
-  void reset_stmt() {
-    auto r = sqlite3_reset(stmt_.get());
-    check_sqlite_return(r);
-    r = sqlite3_clear_bindings(stmt_.get());
-    check_sqlite_return(r);
+  static registry &get_registry() {
+    static registry r;
+    return r;
   }
 
  public:
-  prepared_statement(sqlite3 *sqldb) {
-    auto sv = Query.sv();
-    sqlite3_stmt *stmt;
-    auto specs = parse_type_specs<Query, true, true>();
-    auto query_string = get_sql_string(sv, specs);
-    auto rc =
-        sqlite3_prepare_v2(sqldb, query_string.c_str(),
-                           static_cast<int>(query_string.size()), &stmt, 0);
-    check_sqlite_return(rc);
-    stmt_.reset(stmt);
+  // Caches the statements of sqldb until clear is called.
+  static void enable(sqlite3 *sqldb) {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    r.caches.try_emplace(sqldb);
   }
-  template <typename... Args>
-  row_range<RowType> execute_rows(Args &&... args) {
-    reset_stmt();
 
-    PTuple p_tuple = {};
-    tagged_tuple a_tuple{std::forward<Args>(args)...};
-    do_binding(stmt_.get(), p_tuple, a_tuple);
-    return row_range<RowType>(stmt_.get());
+  // Returns the cached statement for id, or nullptr if there is none.
+  static unique_stmt take(sqlite3 *sqldb, std::size_t id) {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    auto it = r.caches.find(sqldb);
+    if (it == r.caches.end()) return nullptr;
+    auto &cache = it->second;
+    if (id < cache.slots_.size() && cache.slots_[id]) {
+      ++cache.hits_;
+      return std::move(cache.slots_[id]);
+    }
+    ++cache.misses_;
+    return nullptr;
   }
-template <typename... Args>
-  std::optional<decltype(to_concrete(std::declval<RowType>()))> execute_single_row(Args &&... args) {
-      auto rng = execute_rows(std::forward<Args>(args)...);
-      auto begin = rng.begin();
-      if(begin != rng.end()){
-          return to_concrete(*begin);
-      } else{
-          return std::nullopt;
-      }
+
+  // Finalizes stmt if caching is off for its connection, or if there already
+  // is a statement for id.
+  static void put(std::size_t id, unique_stmt stmt) {
+    sqlite3_reset(stmt.get());
+    sqlite3_clear_bindings(stmt.get());
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    auto it = r.caches.find(sqlite3_db_handle(stmt.get()));
+    if (it == r.caches.end()) return;
+    auto &cache = it->second;
+    if (id >= cache.slots_.size()) cache.slots_.resize(id + 1);
+    if (!cache.slots_[id]) cache.slots_[id] = std::move(stmt);
   }
-  template <typename... Args>
-  void execute(Args &&... args) {
-    reset_stmt();
 
-    PTuple p_tuple = {};
-    tagged_tuple a_tuple{std::forward<Args>(args)...};
-    do_binding(stmt_.get(), p_tuple, a_tuple);
-    auto r = sqlite3_step(stmt_.get());
-    check_sqlite_return(r, SQLITE_DONE);
+  // Finalizes the cached statements of sqldb and turns caching off for it.
+  static void clear(sqlite3 *sqldb) {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    r.caches.erase(sqldb);
+  }
+
+  static std::size_t hits(sqlite3 *sqldb) {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    auto it = r.caches.find(sqldb);
+    return it == r.caches.end() ? 0 : it->second.hits_;
+  }
+
+  static std::size_t misses(sqlite3 *sqldb) {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    auto it = r.caches.find(sqldb);
+    return it == r.caches.end() ? 0 : it->second.misses_;
+  }
+};
+
+// Puts the statement back into the cache of its connection.
+struct stmt_returner {
+  std::size_t id;
+  void operator()(sqlite3_stmt *s) noexcept {
+    if (!s) return;
+    try {
+      statement_cache::put(id, unique_stmt(s));
+    } catch (...) {
+      // The statement was finalized instead of cached.
+    }
   }
 };
 
+using cached_stmt = std::unique_ptr<sqlite3_stmt, stmt_returner>;
+
+// Begins a transaction unless the connection already is in one, and rolls it
+// back if it is destroyed before commit.
+class transaction {
+  sqlite3 *sqldb_ = nullptr;
+
+  static void exec(sqlite3 *sqldb, const char *sql) {
+    auto r = sqlite3_exec(sqldb, sql, nullptr, nullptr, nullptr);
+    check_sqlite_return(r);
+  }
+
+ public:
+  explicit transaction(sqlite3 *sqldb) {
+    if (sqlite3_get_autocommit(sqldb)) {
+      exec(sqldb, "BEGIN");
+      sqldb_ = sqldb;
+    }
+  }
+  transaction(const transaction &) = delete;
+  transaction &operator=(const transaction &) = delete;
+
+  void commit() {
+    if (sqldb_) {
+      exec(sqldb_, "COMMIT");
+      sqldb_ = nullptr;
+    }
+  }
+
+  ~transaction() {
+    if (sqldb_) sqlite3_exec(sqldb_, "ROLLBACK", nullptr, nullptr, nullptr);
+  }
+};
+
+// Sample parameter values that match rows of fill_synthetic_rows.
+inline void set_sample(std::int64_t &v) { v = 1; }
+inline void set_sample(double &v) { v = 0.25; }
+inline void set_sample(std::string_view &v) { v = "v1"; }
+inline void set_sample(std::span<const std::byte> &) {}
+
+template <typename T>
+void set_sample(std::optional<T> &v) {
+  set_sample(v.emplace());
+}
+
+template <typename PTuple>
+void bind_samples(sqlite3_stmt *stmt) {
+  PTuple parameters;
+  for_each(parameters, [](auto &m) { set_sample(m.value); });
+  bind_tuple<PTuple>(stmt, SQLITE_TRANSIENT, parameters);
+}
+
+struct registered_query {
+  std::string_view sql;
+  // Binds a sample value to each parameter.
+  void (*bind_samples)(sqlite3_stmt *);
+};
+
+// The SQL of every prepared_statement<Query> whose constructor is in the
+// program, added during static initialization.
+class query_registry {
+  struct registry {
+    std::mutex mutex;
+    std::vector<registered_query> queries;
+  };
+
+  static registry &get_registry() {
+    static registry r;
+    return r;
+  }
+
+ public:
+  static bool add(registered_query query) {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    r.queries.push_back(query);
+    return true;
+  }
+
+  static std::vector<registered_query> entries() {
+    auto &r = get_registry();
+    std::lock_guard lock(r.mutex);
+    return r.queries;
+  }
+
+  static std::vector<std::string_view> queries() {
+    std::vector<std::string_view> sql;
+    for (auto &query : entries()) sql.push_back(query.sql);
+    return sql;
+  }
+};
+
+template <fixed_string Query>
+class prepared_statement {
+  using RowType = decltype(make_members<Query>());
+  using PTuple = decltype(make_parameters<Query>());
+
+  cached_stmt stmt_;
+  std::optional<row_reader<RowType>> reader_;
+  std::size_t columns_rows_hint_ = 0;
+  static inline const bool registered_ =
+      query_registry::add({sql_string<Query>.sv(), &bind_samples<PTuple>});
+  void reset_stmt() {
+    auto r = sqlite3_reset(stmt_.get());
+    check_sqlite_return(r);
+    r = sqlite3_clear_bindings(stmt_.get());
+    check_sqlite_return(r);
+  }
+  // Drops bindings to text that is about to go away. The result of reset is
+  // the error of the last step, which the caller already checked.
+  void release_bindings() {
+    sqlite3_reset(stmt_.get());
+    sqlite3_clear_bindings(stmt_.get());
+  }
+  void step_done() {
+    auto r = sqlite3_step(stmt_.get());
+    release_bindings();
+    check_sqlite_return(r, SQLITE_DONE);
+  }
+  // The columns are checked the first time rows are read.
+  const row_reader<RowType> &reader() {
+    if (!reader_) reader_.emplace(stmt_.get());
+    return *reader_;
+  }
+
+ public:
+  // Uses the statement cached for sqldb if caching is enabled and there is
+  // one.
+  prepared_statement(sqlite3 *sqldb)
+      : stmt_(statement_cache::take(sqldb, statement_id<Query>).release(),
+              stmt_returner{statement_id<Query>}) {
+    (void)registered_;
+    if (stmt_) return;
+    sqlite3_stmt *stmt;
+    auto rc = sqlite3_prepare_v2(sqldb, sql_string<Query>.data,
+                                 static_cast<int>(sql_string<Query>.size()),
+                                 &stmt, 0);
+    check_sqlite_return(rc);
+    stmt_.reset(stmt);
+  }
+  template <typename... Args>
+  row_range<RowType> execute_rows(Args &&... args) {
+    reset_stmt();
+
+    bind_parameters<PTuple>(stmt_.get(), SQLITE_TRANSIENT, args...);
+    return row_range<RowType>(stmt_.get(), reader());
+  }
+template <typename... Args>
+  std::optional<decltype(to_concrete(std::declval<RowType>()))> execute_single_row(Args &&... args) {
+      auto rng = execute_rows(std::forward<Args>(args)...);
+      auto begin = rng.begin();
+      if(begin != rng.end()){
+          return to_concrete(*begin);
+      } else{
+          return std::nullopt;
+      }
+  }
+
+  // The range must be destroyed before the statement is used again.
+  template <typename... Args>
+  buffered_row_range<RowType> execute_rows_buffered(row_buffering buffering,
+                                                    Args &&... args) {
+    reset_stmt();
+
+    bind_parameters<PTuple>(stmt_.get(), SQLITE_TRANSIENT, args...);
+    return buffered_row_range<RowType>(stmt_.get(), reader(), buffering);
+  }
+
+  // Binds args on the calling thread, and steps the statement in a task given
+  // to executor.add(std::function<void()>), such as the thread_pool of
+  // FutureExecutor. At most capacity rows are read ahead of the caller. The
+  // statement must not be used until the returned channel is destroyed.
+  // Reading the channel waits for the task to run, so the executor must not
+  // depend on the reader to make progress. Destroying the channel before the
+  // task started does not wait for it, and the task then does nothing.
+  template <typename Executor, typename... Args>
+  row_channel<decltype(to_concrete(std::declval<RowType>()))>
+  async_execute_rows(Executor &executor, Args &&... args) {
+    using Row = decltype(to_concrete(std::declval<RowType>()));
+    reset_stmt();
+
+    bind_parameters<PTuple>(stmt_.get(), SQLITE_TRANSIENT, args...);
+    auto state = std::make_shared<row_channel_state<Row>>(
+        async_channel_capacity);
+    std::function<void()> task = [state, stmt = stmt_.get(),
+                                  reader = reader()] {
+      produce_rows<RowType>(stmt, reader, *state);
+    };
+    try {
+      executor.add(std::move(task));
+    } catch (...) {
+      state->close(nullptr);
+      throw;
+    }
+    return row_channel<Row>(std::move(state));
+  }
+
+  static constexpr std::size_t async_channel_capacity = 1024;
+
+  using ColumnsType = decltype(columns_for(std::declval<RowType>()));
+
+  // Reads all the rows into one container per column. Each column reserves
+  // the number of rows of the previous call.
+  template <typename... Args>
+  ColumnsType execute_columns(Args &&... args) {
+    ColumnsType columns;
+    for_each(columns, [&](auto &m) { m.value.reserve(columns_rows_hint_); });
+    std::size_t rows = 0;
+    for (auto &row : execute_rows(std::forward<Args>(args)...)) {
+      for_each(row, [&](auto &m) {
+        using tag = typename std::decay_t<decltype(m)>::tag_type;
+        get<tag>(columns).push_back(m.value);
+      });
+      ++rows;
+    }
+    columns_rows_hint_ = rows;
+    return columns;
+  }
+
+  // Like execute_single_row, but calls f with the row instead of copying it.
+  // The std::string_views in the row are only valid during the call. Text
+  // parameters are not copied. Returns false if there was no row.
+  template <typename F, typename... Args>
+  bool execute_single_row_view(F &&f, Args &&... args) {
+    reset_stmt();
+
+    bind_parameters<PTuple>(stmt_.get(), SQLITE_STATIC, args...);
+    row_range<RowType> rng(stmt_.get(), reader());
+    auto begin = rng.begin();
+    bool found = begin != rng.end();
+    if (found) {
+      std::forward<F>(f)(std::as_const(*begin));
+    }
+    release_bindings();
+    return found;
+  }
+  template <typename... Args>
+  void execute(Args &&... args) {
+    reset_stmt();
+
+    bind_parameters<PTuple>(stmt_.get(), SQLITE_STATIC, args...);
+    step_done();
+  }
+
+  // Text parameters are bound without copying them, as they outlive the step.
+  template <typename ATuple>
+  void execute_tuple(const ATuple &a_tuple) {
+    reset_stmt();
+
+    bind_tuple<PTuple>(stmt_.get(), SQLITE_STATIC, a_tuple);
+    step_done();
+  }
+
+  // Executes the statement for each tagged_tuple of parameters in rows, in a
+  // single transaction.
+  template <typename Range>
+  void execute_many(Range &&rows) {
+    transaction t(sqlite3_db_handle(stmt_.get()));
+    for (auto &&row : rows) {
+      execute_tuple(row);
+    }
+    t.commit();
+  }
+};
+
+// Executes Query for each write inside a transaction, which is committed after
+// max_rows writes, or by the first write once max_delay has passed since it
+// began. The delay is only checked by write and flush_if_due, so a writer
+// that goes idle keeps its transaction, and the write lock, until one of them
+// or flush is called. Call finish to commit the remaining rows when done,
+// after which the writer cannot write anymore. Destroying the writer rolls
+// back rows that were not committed.
+template <fixed_string Query>
+class batch_writer {
+  prepared_statement<Query> statement_;
+  sqlite3 *sqldb_;
+  std::size_t max_rows_;
+  std::chrono::steady_clock::duration max_delay_;
+  std::optional<transaction> transaction_;
+  std::size_t rows_ = 0;
+  std::chrono::steady_clock::time_point start_;
+  bool finished_ = false;
+
+ public:
+  explicit batch_writer(sqlite3 *sqldb, std::size_t max_rows = 10000,
+                        std::chrono::steady_clock::duration max_delay =
+                            std::chrono::seconds(1))
+      : statement_(sqldb),
+        sqldb_(sqldb),
+        max_rows_(max_rows),
+        max_delay_(max_delay) {}
+  batch_writer(const batch_writer &) = delete;
+  batch_writer &operator=(const batch_writer &) = delete;
+
+  template <typename... Args>
+  void write(Args &&... args) {
+    assert(!finished_);
+    if (finished_) {
+      throw std::runtime_error("sqlite error: batch_writer write after finish");
+    }
+    if (!transaction_) {
+      transaction_.emplace(sqldb_);
+      start_ = std::chrono::steady_clock::now();
+    }
+    statement_.execute(std::forward<Args>(args)...);
+    if (++rows_ >= max_rows_ ||
+        std::chrono::steady_clock::now() - start_ >= max_delay_) {
+      flush();
+    }
+  }
+
+  // Throws if the commit fails. The rows are then rolled back when the writer
+  // is destroyed, unless a later flush succeeds.
+  void flush() {
+    if (transaction_) {
+      transaction_->commit();
+      transaction_.reset();
+    }
+    rows_ = 0;
+  }
+
+  // Commits if max_delay has passed since the transaction began. Call it
+  // periodically while no rows are written.
+  void flush_if_due() {
+    if (transaction_ &&
+        std::chrono::steady_clock::now() - start_ >= max_delay_) {
+      flush();
+    }
+  }
+
+  void finish() {
+    flush();
+    finished_ = true;
+  }
+};
+
+// Incremental reads and writes of one blob, without loading all of it. The
+// size of a blob cannot change this way, so rows to be written are inserted
+// with zeroblob(n) first, e.g. "VALUES(zeroblob(?size:integer))".
+class blob {
+  sqlite3_blob *blob_ = nullptr;
+
+  // The blob API takes int sizes and offsets.
+  static void check_range(std::size_t size, std::size_t offset) {
+    constexpr std::size_t max = std::numeric_limits<int>::max();
+    bool in_range = size <= max && offset <= max;
+    assert(in_range);
+    if (!in_range) {
+      throw std::runtime_error("sqlite error: blob range does not fit in int");
+    }
+  }
+
+ public:
+  blob(sqlite3 *sqldb, const char *table, const char *column,
+       std::int64_t rowid, bool writable = false,
+       const char *database = "main") {
+    auto r = sqlite3_blob_open(sqldb, database, table, column, rowid,
+                               writable ? 1 : 0, &blob_);
+    if (r != SQLITE_OK) {
+      sqlite3_blob_close(blob_);
+      check_sqlite_return(r);
+    }
+  }
+  blob(const blob &) = delete;
+  blob &operator=(const blob &) = delete;
+
+  ~blob() { sqlite3_blob_close(blob_); }
+
+  std::size_t size() const {
+    return static_cast<std::size_t>(sqlite3_blob_bytes(blob_));
+  }
+
+  void read(std::span<std::byte> out, std::size_t offset) const {
+    check_range(out.size(), offset);
+    auto r = sqlite3_blob_read(blob_, out.data(), static_cast<int>(out.size()),
+                               static_cast<int>(offset));
+    check_sqlite_return(r);
+  }
+
+  void write(std::span<const std::byte> in, std::size_t offset) {
+    check_range(in.size(), offset);
+    auto r = sqlite3_blob_write(blob_, in.data(), static_cast<int>(in.size()),
+                                static_cast<int>(offset));
+    check_sqlite_return(r);
+  }
+
+  // Moves to the same column of another row, which is faster than opening a
+  // new blob.
+  void reopen(std::int64_t rowid) {
+    auto r = sqlite3_blob_reopen(blob_, rowid);
+    check_sqlite_return(r);
+  }
+};
+
+// Connections to one database file in WAL mode, so that readers do not block
+// each other or the writer. Each connection is used by one lease at a time and
+// keeps its own prepared statements. All leases must be destroyed before the
+// pool.
+class connection_pool {
+  class connection {
+    sqlite3 *sqldb_ = nullptr;
+    std::vector<std::shared_ptr<void>> statements_;
+
+   public:
+    explicit connection(const std::string &filename) {
+      auto r = sqlite3_open_v2(
+          filename.c_str(), &sqldb_,
+          SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+          nullptr);
+      if (r != SQLITE_OK) {
+        sqlite3_close(sqldb_);
+        check_sqlite_return(r);
+      }
+      try {
+        r = sqlite3_exec(sqldb_, "PRAGMA journal_mode=WAL", nullptr, nullptr,
+                         nullptr);
+        check_sqlite_return(r);
+        r = sqlite3_busy_timeout(sqldb_, 5000);
+        check_sqlite_return(r);
+        statement_cache::enable(sqldb_);
+      } catch (...) {
+        sqlite3_close(sqldb_);
+        throw;
+      }
+    }
+    connection(const connection &) = delete;
+    connection &operator=(const connection &) = delete;
+
+    ~connection() {
+      statements_.clear();
+      statement_cache::clear(sqldb_);
+      sqlite3_close(sqldb_);
+    }
+
+    sqlite3 *get() const { return sqldb_; }
+
+    template <fixed_string Query>
+    prepared_statement<Query> &statement() {
+      auto id = statement_id<Query>;
+      if (id >= statements_.size()) statements_.resize(id + 1);
+      auto &slot = statements_[id];
+      if (!slot) slot = std::make_shared<prepared_statement<Query>>(sqldb_);
+      return *static_cast<prepared_statement<Query> *>(slot.get());
+    }
+  };
+
+  std::vector<std::unique_ptr<connection>> connections_;
+  std::mutex mutex_;
+  std::condition_variable released_;
+  std::vector<connection *> free_;
+
+  void release(connection *c) {
+    {
+      std::lock_guard lock(mutex_);
+      free_.push_back(c);
+    }
+    released_.notify_one();
+  }
+
+ public:
+  connection_pool(const std::string &filename, std::size_t size) {
+    connections_.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      connections_.push_back(std::make_unique<connection>(filename));
+      free_.push_back(connections_.back().get());
+    }
+  }
+  connection_pool(const connection_pool &) = delete;
+  connection_pool &operator=(const connection_pool &) = delete;
+
+  std::size_t size() const { return connections_.size(); }
+
+  // Exclusive use of one connection until destroyed.
+  class lease {
+    connection_pool *pool_ = nullptr;
+    connection *connection_ = nullptr;
+
+    friend class connection_pool;
+    lease(connection_pool *pool, connection *c)
+        : pool_(pool), connection_(c) {}
+
+   public:
+    lease(lease &&other) noexcept
+        : pool_(std::exchange(other.pool_, nullptr)),
+          connection_(std::exchange(other.connection_, nullptr)) {}
+    lease &operator=(lease &&other) noexcept {
+      if (this != &other) {
+        if (connection_) pool_->release(connection_);
+        pool_ = std::exchange(other.pool_, nullptr);
+        connection_ = std::exchange(other.connection_, nullptr);
+      }
+      return *this;
+    }
+    ~lease() {
+      if (connection_) pool_->release(connection_);
+    }
+
+    sqlite3 *get() const { return connection_->get(); }
+
+    // The statement for Query on this connection, prepared on first use.
+    template <fixed_string Query>
+    prepared_statement<Query> &statement() {
+      return connection_->template statement<Query>();
+    }
+  };
+
+  // Waits until a connection is free.
+  lease acquire() {
+    std::unique_lock lock(mutex_);
+    released_.wait(lock, [&] { return !free_.empty(); });
+    auto c = free_.back();
+    free_.pop_back();
+    return lease(this, c);
+  }
+
+  std::optional<lease> try_acquire() {
+    std::lock_guard lock(mutex_);
+    if (free_.empty()) return std::nullopt;
+    auto c = free_.back();
+    free_.pop_back();
+    return lease(this, c);
+  }
+};
+
+template <fixed_string fs>
+constexpr std::string_view tag_name(compile_string<fs>) {
+  return fs.sv();
+}
+
+inline const char *column_type_name(std::int64_t) { return "INTEGER"; }
+inline const char *column_type_name(double) { return "REAL"; }
+inline const char *column_type_name(std::string_view) { return "TEXT"; }
+inline const char *column_type_name(std::span<const std::byte>) {
+  return "BLOB";
+}
+template <typename T>
+const char *column_type_name(const std::optional<T> &) {
+  return column_type_name(T{});
+}
+
+inline void set_result(sqlite3_context *ctx, std::int64_t v) {
+  sqlite3_result_int64(ctx, v);
+}
+inline void set_result(sqlite3_context *ctx, double v) {
+  sqlite3_result_double(ctx, v);
+}
+// The text is not copied, as the rows do not change while registered.
+inline void set_result(sqlite3_context *ctx, std::string_view v) {
+  sqlite3_result_text(ctx, v.data(), static_cast<int>(v.size()),
+                      SQLITE_STATIC);
+}
+inline void set_result(sqlite3_context *ctx, std::span<const std::byte> v) {
+  if (v.data()) {
+    sqlite3_result_blob64(ctx, v.data(), v.size(), SQLITE_STATIC);
+  } else {
+    sqlite3_result_zeroblob(ctx, 0);
+  }
+}
+template <typename T>
+void set_result(sqlite3_context *ctx, const std::optional<T> &v) {
+  if (v) {
+    set_result(ctx, *v);
+  } else {
+    sqlite3_result_null(ctx);
+  }
+}
+
+// Compares v with value in the order of sqlite. Returns nullopt when they are
+// not comparable without conversions, such as text and numbers.
+inline std::optional<int> compare_value(std::int64_t v, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+    case SQLITE_INTEGER: {
+      auto i = sqlite3_value_int64(value);
+      return (v > i) - (v < i);
+    }
+    case SQLITE_FLOAT: {
+      auto d = sqlite3_value_double(value);
+      auto f = static_cast<double>(v);
+      return (f > d) - (f < d);
+    }
+    default:
+      return std::nullopt;
+  }
+}
+inline std::optional<int> compare_value(double v, sqlite3_value *value) {
+  auto type = sqlite3_value_type(value);
+  if (type != SQLITE_INTEGER && type != SQLITE_FLOAT) return std::nullopt;
+  auto d = sqlite3_value_double(value);
+  return (v > d) - (v < d);
+}
+inline std::optional<int> compare_value(std::string_view v,
+                                        sqlite3_value *value) {
+  if (sqlite3_value_type(value) != SQLITE_TEXT) return std::nullopt;
+  std::string_view text(
+      reinterpret_cast<const char *>(sqlite3_value_text(value)),
+      sqlite3_value_bytes(value));
+  auto c = v.compare(text);
+  return (c > 0) - (c < 0);
+}
+inline std::optional<int> compare_value(std::span<const std::byte> v,
+                                        sqlite3_value *value) {
+  if (sqlite3_value_type(value) != SQLITE_BLOB) return std::nullopt;
+  auto ptr = static_cast<const std::byte *>(sqlite3_value_blob(value));
+  std::span<const std::byte> blob(ptr, ptr ? sqlite3_value_bytes(value) : 0);
+  auto c = std::lexicographical_compare_three_way(v.begin(), v.end(),
+                                                  blob.begin(), blob.end());
+  return (c > 0) - (c < 0);
+}
+// NULL sorts before all values.
+template <typename T>
+std::optional<int> compare_value(const std::optional<T> &v,
+                                 sqlite3_value *value) {
+  if (!v) return -1;
+  return compare_value(*v, value);
+}
+
+template <typename T>
+bool is_comparable(const T &v, sqlite3_value *value) {
+  return compare_value(v, value).has_value();
+}
+template <typename T>
+bool is_comparable(const std::optional<T> &, sqlite3_value *value) {
+  return compare_value(T{}, value).has_value();
+}
+
+// The order of sqlite, for sorting the rows of a span_table.
+template <typename T>
+bool value_less(const T &a, const T &b) {
+  return a < b;
+}
+inline bool value_less(std::span<const std::byte> a,
+                       std::span<const std::byte> b) {
+  return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+}
+template <typename T>
+bool value_less(const std::optional<T> &a, const std::optional<T> &b) {
+  if (!a || !b) return !a && b;
+  return value_less(*a, *b);
+}
+
+template <std::size_t I, typename... Members>
+const auto &column_value(const tagged_tuple<Members...> &row) {
+  using M = std::tuple_element_t<I, std::tuple<Members...>>;
+  return static_cast<const M &>(row).value;
+}
+
+// Calls f with std::integral_constant<std::size_t, index>.
+template <std::size_t... I, typename F>
+void with_column_index(int index, std::index_sequence<I...>, F &&f) {
+  ((index == static_cast<int>(I)
+        ? (f(std::integral_constant<std::size_t, I>{}), 0)
+        : 0),
+   ...);
+}
+
+// An eponymous virtual table over rows. Constraints on one column are used to
+// narrow the scan to a range of a sorted permutation of the rows, which is
+// built the first time the column is constrained. Equality is preferred over
+// ranges. sqlite checks all the constraints on the rows of the range again.
+template <typename Row>
+class span_table {
+  static constexpr int column_count = static_cast<int>(tuple_size(Row{}));
+
+  std::span<const Row> rows_;
+  std::array<std::vector<std::size_t>, column_count> sorted_;
+
+  struct table : sqlite3_vtab {
+    span_table *owner;
+  };
+
+  struct cursor : sqlite3_vtab_cursor {
+    const std::vector<std::size_t> *order = nullptr;
+    std::size_t position = 0;
+    std::size_t end = 0;
+    std::size_t row() const { return order ? (*order)[position] : position; }
+  };
+
+  static span_table &owner(sqlite3_vtab_cursor *c) {
+    return *static_cast<table *>(c->pVtab)->owner;
+  }
+
+  template <typename F>
+  static void with_column(int column, F &&f) {
+    with_column_index(column, std::make_index_sequence<column_count>(),
+                      std::forward<F>(f));
+  }
+
+  const std::vector<std::size_t> &sorted(int column) {
+    auto &order = sorted_[column];
+    if (order.size() != rows_.size()) {
+      order.resize(rows_.size());
+      for (std::size_t i = 0; i < order.size(); ++i) order[i] = i;
+      with_column(column, [&](auto I) {
+        std::stable_sort(order.begin(), order.end(),
+                         [&](std::size_t a, std::size_t b) {
+                           return value_less(column_value<I>(rows_[a]),
+                                             column_value<I>(rows_[b]));
+                         });
+      });
+    }
+    return order;
+  }
+
+  static int connect(sqlite3 *sqldb, void *aux, int, const char *const *,
+                     sqlite3_vtab **vtab, char **) {
+    std::string schema = "CREATE TABLE x(";
+    bool first = true;
+    for_each(Row{}, [&](auto &m) {
+      using tag = typename std::decay_t<decltype(m)>::tag_type;
+      if (!first) schema += ", ";
+      first = false;
+      schema += tag_name(tag{});
+      schema += " ";
+      schema += column_type_name(m.value);
+    });
+    schema += ")";
+    auto r = sqlite3_declare_vtab(sqldb, schema.c_str());
+    if (r != SQLITE_OK) return r;
+    auto t = new table{};
+    t->owner = static_cast<span_table *>(aux);
+    *vtab = t;
+    return SQLITE_OK;
+  }
+
+  static int disconnect(sqlite3_vtab *vtab) {
+    delete static_cast<table *>(vtab);
+    return SQLITE_OK;
+  }
+
+  static bool is_supported(unsigned char op) {
+    return op == SQLITE_INDEX_CONSTRAINT_EQ ||
+           op == SQLITE_INDEX_CONSTRAINT_GT ||
+           op == SQLITE_INDEX_CONSTRAINT_GE ||
+           op == SQLITE_INDEX_CONSTRAINT_LT ||
+           op == SQLITE_INDEX_CONSTRAINT_LE;
+  }
+
+  // idxNum is the constrained column plus one, or 0 for a full scan. idxStr
+  // holds the op of each argument.
+  static int best_index(sqlite3_vtab *vtab, sqlite3_index_info *info) {
+    auto rows =
+        static_cast<double>(static_cast<table *>(vtab)->owner->rows_.size());
+    int column = -1;
+    bool equal = false;
+    for (int i = 0; i < info->nConstraint; ++i) {
+      auto &c = info->aConstraint[i];
+      if (!c.usable || c.iColumn < 0 || !is_supported(c.op)) continue;
+      if (std::string_view(sqlite3_vtab_collation(info, i)) != "BINARY") {
+        continue;
+      }
+      if (column == -1 || (!equal && c.op == SQLITE_INDEX_CONSTRAINT_EQ)) {
+        column = c.iColumn;
+        equal = c.op == SQLITE_INDEX_CONSTRAINT_EQ;
+      }
+    }
+    if (column == -1) {
+      info->idxNum = 0;
+      info->estimatedCost = rows;
+      info->estimatedRows = static_cast<sqlite3_int64>(rows);
+      return SQLITE_OK;
+    }
+    std::string ops;
+    for (int i = 0; i < info->nConstraint; ++i) {
+      auto &c = info->aConstraint[i];
+      if (!c.usable || c.iColumn != column || !is_supported(c.op)) continue;
+      if (std::string_view(sqlite3_vtab_collation(info, i)) != "BINARY") {
+        continue;
+      }
+      ops += static_cast<char>(c.op);
+      info->aConstraintUsage[i].argvIndex = static_cast<int>(ops.size());
+    }
+    auto matches = equal ? std::min(rows, 10.0) : rows / 4;
+    info->idxNum = column + 1;
+    info->idxStr = sqlite3_mprintf("%s", ops.c_str());
+    info->needToFreeIdxStr = 1;
+    info->estimatedCost = std::log2(rows + 1) + matches;
+    info->estimatedRows = static_cast<sqlite3_int64>(matches) + 1;
+    return SQLITE_OK;
+  }
+
+  static int open(sqlite3_vtab *, sqlite3_vtab_cursor **c) {
+    *c = new cursor{};
+    return SQLITE_OK;
+  }
+
+  static int close(sqlite3_vtab_cursor *c) {
+    delete static_cast<cursor *>(c);
+    return SQLITE_OK;
+  }
+
+  static int filter(sqlite3_vtab_cursor *base, int idx_num,
+                    const char *idx_str, int argc, sqlite3_value **argv) {
+    auto c = static_cast<cursor *>(base);
+    auto &self = owner(base);
+    c->order = nullptr;
+    c->position = 0;
+    c->end = self.rows_.size();
+    if (idx_num == 0) return SQLITE_OK;
+    int column = idx_num - 1;
+    try {
+      auto &order = self.sorted(column);
+      std::size_t begin = 0;
+      std::size_t end = order.size();
+      self.with_column(column, [&](auto I) {
+        for (int i = 0; i < argc; ++i) {
+          if (!is_comparable(column_value<I>(Row{}), argv[i])) continue;
+          // The index of the first row that does not compare below limit.
+          auto bound = [&](int limit) {
+            auto it = std::partition_point(
+                order.begin(), order.end(), [&](std::size_t row) {
+                  return *compare_value(column_value<I>(self.rows_[row]),
+                                        argv[i]) < limit;
+                });
+            return static_cast<std::size_t>(it - order.begin());
+          };
+          switch (static_cast<unsigned char>(idx_str[i])) {
+            case SQLITE_INDEX_CONSTRAINT_EQ:
+              begin = std::max(begin, bound(0));
+              end = std::min(end, bound(1));
+              break;
+            case SQLITE_INDEX_CONSTRAINT_GT:
+              begin = std::max(begin, bound(1));
+              break;
+            case SQLITE_INDEX_CONSTRAINT_GE:
+              begin = std::max(begin, bound(0));
+              break;
+            case SQLITE_INDEX_CONSTRAINT_LT:
+              end = std::min(end, bound(0));
+              break;
+            case SQLITE_INDEX_CONSTRAINT_LE:
+              end = std::min(end, bound(1));
+              break;
+          }
+        }
+      });
+      c->order = &order;
+      c->position = begin;
+      c->end = std::max(begin, end);
+    } catch (const std::bad_alloc &) {
+      return SQLITE_NOMEM;
+    }
+    return SQLITE_OK;
+  }
+
+  static int next(sqlite3_vtab_cursor *c) {
+    ++static_cast<cursor *>(c)->position;
+    return SQLITE_OK;
+  }
+
+  static int eof(sqlite3_vtab_cursor *base) {
+    auto c = static_cast<cursor *>(base);
+    return c->position >= c->end;
+  }
+
+  static int column(sqlite3_vtab_cursor *base, sqlite3_context *ctx, int i) {
+    auto c = static_cast<cursor *>(base);
+    with_column(i, [&](auto I) {
+      set_result(ctx, column_value<I>(owner(base).rows_[c->row()]));
+    });
+    return SQLITE_OK;
+  }
+
+  static int rowid(sqlite3_vtab_cursor *base, sqlite3_int64 *id) {
+    *id = static_cast<sqlite3_int64>(static_cast<cursor *>(base)->row());
+    return SQLITE_OK;
+  }
+
+ public:
+  explicit span_table(std::span<const Row> rows) : rows_(rows) {}
+
+  // Without xCreate, the module can only be used as a table of the same name.
+  // The members that are not set are null, including those of newer SQLite
+  // versions.
+  static sqlite3_module make_module() {
+    sqlite3_module m = {};
+    m.iVersion = 0;
+    m.xConnect = connect;
+    m.xBestIndex = best_index;
+    m.xDisconnect = disconnect;
+    m.xDestroy = disconnect;
+    m.xOpen = open;
+    m.xClose = close;
+    m.xFilter = filter;
+    m.xNext = next;
+    m.xEof = eof;
+    m.xColumn = column;
+    m.xRowid = rowid;
+    return m;
+  }
+
+  static inline const sqlite3_module module = make_module();
+};
+
+// Makes rows readable as the table name of sqldb, without copying them. The
+// rows must not change and must outlive the connection. Each name can only be
+// registered once per connection.
+template <typename Row>
+void register_span_table(sqlite3 *sqldb, const char *name,
+                         std::span<const Row> rows) {
+  auto r = sqlite3_create_module_v2(
+      sqldb, name, &span_table<Row>::module, new span_table<Row>(rows),
+      [](void *p) { delete static_cast<span_table<Row> *>(p); });
+  check_sqlite_return(r);
+}
+
+struct query_plan_options {
+  // Scans of tables with fewer rows are not reported.
+  std::int64_t min_scan_rows = 1000;
+  // How many times each read only statement is run to time it.
+  int repetitions = 10;
+};
+
+struct query_plan {
+  std::string_view sql;
+  // The detail column of EXPLAIN QUERY PLAN.
+  std::vector<std::string> details;
+  // Tables with at least min_scan_rows rows that are scanned, and scanned
+  // names that are not subqueries and whose rows cannot be counted.
+  std::vector<std::string> full_scans;
+  // Average time of one run with the sample parameters of set_sample, which
+  // match rows of fill_synthetic_rows. Zero unless read only.
+  std::chrono::nanoseconds time{0};
+  // Why the statement could not be explained or run.
+  std::string error;
+};
+
+namespace query_plan_detail {
+
+struct stmt_deleter {
+  void operator()(sqlite3_stmt *s) const { sqlite3_finalize(s); }
+};
+using stmt_ptr = std::unique_ptr<sqlite3_stmt, stmt_deleter>;
+
+inline stmt_ptr prepare(sqlite3 *sqldb, const std::string &sql,
+                        std::string &error) {
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(sqldb, sql.c_str(), static_cast<int>(sql.size()),
+                         &stmt, nullptr) != SQLITE_OK) {
+    error = sqlite3_errmsg(sqldb);
+  }
+  return stmt_ptr(stmt);
+}
+
+// The name of a "SCAN name ..." detail, which is the alias if the table has
+// one. SQLite before 3.36 writes "SCAN TABLE table AS alias" instead.
+// Subqueries, constant rows and virtual tables are not table scans.
+inline std::optional<std::string> scanned_name(std::string_view detail) {
+  constexpr std::string_view scan = "SCAN ";
+  constexpr std::string_view table = "TABLE ";
+  if (detail.substr(0, scan.size()) != scan) return std::nullopt;
+  if (detail.find("VIRTUAL TABLE") != detail.npos) return std::nullopt;
+  auto name = detail.substr(scan.size());
+  if (name.substr(0, table.size()) == table) name = name.substr(table.size());
+  name = name.substr(0, name.find(' '));
+  if (name.empty() || name[0] == '(' || name == "CONSTANT" ||
+      name == "SUBQUERY") {
+    return std::nullopt;
+  }
+  return std::string(name);
+}
+
+// The identifiers, without quotes, and the punctuation of sql. String
+// literals are left out.
+inline std::vector<std::string> sql_tokens(std::string_view sql) {
+  std::vector<std::string> tokens;
+  std::size_t i = 0;
+  auto is_name = [](char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+  };
+  while (i < sql.size()) {
+    char c = sql[i];
+    if (std::isspace(static_cast<unsigned char>(c))) {
+      ++i;
+    } else if (c == '\'' || c == '"' || c == '`' || c == '[') {
+      char close = c == '[' ? ']' : c;
+      auto end = sql.find(close, i + 1);
+      if (end == sql.npos) end = sql.size();
+      if (c != '\'') tokens.emplace_back(sql.substr(i + 1, end - i - 1));
+      i = end + 1;
+    } else if (is_name(c)) {
+      auto start = i;
+      while (i < sql.size() && is_name(sql[i])) ++i;
+      tokens.emplace_back(sql.substr(start, i - start));
+    } else {
+      tokens.emplace_back(1, c);
+      ++i;
+    }
+  }
+  return tokens;
+}
+
+inline std::string upper(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  return s;
+}
+
+// Maps the names that EXPLAIN QUERY PLAN reports for the FROM clauses of sql
+// to their tables. Aliases map to their table, and the names of subqueries
+// and common table expressions map to an empty string.
+inline std::unordered_map<std::string, std::string> from_names(
+    std::string_view sql) {
+  static constexpr std::string_view keywords[] = {
+      "AS",        "CROSS",   "EXCEPT", "FULL",    "GROUP", "HAVING",
+      "INDEXED",   "INNER",   "INTERSECT", "JOIN", "LEFT",  "LIMIT",
+      "NATURAL",   "NOT",     "ON",     "ORDER",   "OUTER", "RETURNING",
+      "RIGHT",     "UNION",   "USING",  "WHERE",   "WINDOW"};
+  auto tokens = sql_tokens(sql);
+  auto token = [&](std::size_t i) {
+    return i < tokens.size() ? upper(tokens[i]) : std::string();
+  };
+  auto is_name = [&](std::size_t i) {
+    auto t = token(i);
+    if (t.empty() || !(std::isalpha(static_cast<unsigned char>(t[0])) ||
+                       t[0] == '_')) {
+      return false;
+    }
+    return std::find(std::begin(keywords), std::end(keywords), t) ==
+           std::end(keywords);
+  };
+  // Returns the index after the parenthesis that closes the one at i.
+  auto skip_parentheses = [&](std::size_t i) {
+    int depth = 0;
+    for (; i < tokens.size(); ++i) {
+      if (tokens[i] == "(") ++depth;
+      if (tokens[i] == ")" && --depth == 0) return i + 1;
+    }
+    return i;
+  };
+  static constexpr std::string_view from_ends[] = {
+      ";",     "EXCEPT", "GROUP",     "HAVING", "INTERSECT",
+      "LIMIT", "ORDER",  "RETURNING", "UNION",  "WHERE", "WINDOW"};
+  std::unordered_map<std::string, std::string> names;
+  // Whether each open parenthesis is inside a FROM clause.
+  std::vector<bool> in_from(1, false);
+  for (std::size_t i = 0; i < tokens.size(); ++i) {
+    // A common table expression, "name AS (" or "name(columns) AS (".
+    if (is_name(i)) {
+      auto j = token(i + 1) == "(" ? skip_parentheses(i + 1) : i + 1;
+      if (token(j) == "AS" && token(j + 1) == "(") names[tokens[i]] = "";
+    }
+    auto t = token(i);
+    if (t == "(") {
+      in_from.push_back(false);
+    } else if (t == ")") {
+      if (in_from.size() > 1) in_from.pop_back();
+    } else if (t == "FROM") {
+      in_from.back() = true;
+    } else if (std::find(std::begin(from_ends), std::end(from_ends), t) !=
+               std::end(from_ends)) {
+      in_from.back() = false;
+    }
+    if (!in_from.back() || (t != "FROM" && t != "JOIN" && t != ",")) continue;
+    // A table or subquery with an optional alias follows.
+    auto j = i + 1;
+    std::string table;
+    if (token(j) == "(") {
+      j = skip_parentheses(j);
+    } else {
+      if (j < tokens.size()) table = tokens[j];
+      ++j;
+      if (token(j) == "." && j + 1 < tokens.size()) {
+        table = tokens[j + 1];
+        j += 2;
+      }
+      // Table valued functions are virtual tables.
+      if (token(j) == "(") {
+        j = skip_parentheses(j);
+        table.clear();
+      }
+    }
+    if (token(j) == "AS") ++j;
+    if (is_name(j)) names[tokens[j]] = table;
+  }
+  return names;
+}
+
+// Statements that change the schema have no plan, and usually cannot be
+// prepared again once they ran.
+inline bool is_schema_statement(std::string_view sql) {
+  auto start = sql.find_first_not_of(" \t\n");
+  if (start == sql.npos) return false;
+  std::string keyword(sql.substr(start, 6));
+  std::transform(keyword.begin(), keyword.end(), keyword.begin(),
+                 [](unsigned char c) { return std::toupper(c); });
+  return keyword.starts_with("CREATE") || keyword.starts_with("DROP") ||
+         keyword.starts_with("ALTER");
+}
+
+inline std::optional<std::int64_t> count_rows(sqlite3 *sqldb,
+                                              const std::string &table) {
+  std::string error;
+  auto stmt = prepare(sqldb, "SELECT count(*) FROM \"" + table + "\"", error);
+  if (!stmt || sqlite3_step(stmt.get()) != SQLITE_ROW) return std::nullopt;
+  return sqlite3_column_int64(stmt.get(), 0);
+}
+
+}  // namespace query_plan_detail
+
+// Runs EXPLAIN QUERY PLAN for each query in query_registry but schema changes,
+// and times the read only ones with sample parameters. Queries on tables that
+// sqldb does not have get an error.
+inline std::vector<query_plan> explain_queries(
+    sqlite3 *sqldb, query_plan_options options = {}) {
+  using namespace query_plan_detail;
+  std::vector<query_plan> plans;
+  for (auto query : query_registry::entries()) {
+    auto sql = query.sql;
+    if (is_schema_statement(sql)) continue;
+    auto &plan = plans.emplace_back();
+    plan.sql = sql;
+    auto explain = prepare(sqldb, "EXPLAIN QUERY PLAN " + std::string(sql),
+                           plan.error);
+    if (!explain) continue;
+    auto names = from_names(sql);
+    while (sqlite3_step(explain.get()) == SQLITE_ROW) {
+      auto detail = reinterpret_cast<const char *>(
+          sqlite3_column_text(explain.get(), 3));
+      plan.details.emplace_back(detail ? detail : "");
+      auto name = scanned_name(plan.details.back());
+      if (!name) continue;
+      auto table = *name;
+      if (auto it = names.find(table); it != names.end()) {
+        if (it->second.empty()) continue;
+        table = it->second;
+      }
+      auto rows = count_rows(sqldb, table);
+      if (!rows || *rows >= options.min_scan_rows) {
+        plan.full_scans.push_back(table);
+      }
+    }
+    auto stmt = prepare(sqldb, std::string(sql), plan.error);
+    if (!stmt || !sqlite3_stmt_readonly(stmt.get())) continue;
+    query.bind_samples(stmt.get());
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < options.repetitions; ++i) {
+      int r;
+      while ((r = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+      }
+      sqlite3_reset(stmt.get());
+      if (r != SQLITE_DONE) {
+        plan.error = sqlite3_errstr(r);
+        break;
+      }
+    }
+    if (plan.error.empty() && options.repetitions > 0) {
+      plan.time = (std::chrono::steady_clock::now() - start) /
+                  options.repetitions;
+    }
+  }
+  return plans;
+}
+
+// Prints the plans, and returns how many have full scans or errors.
+inline std::size_t print_query_plans(std::ostream &os,
+                                     const std::vector<query_plan> &plans) {
+  std::size_t flagged = 0;
+  for (auto &plan : plans) {
+    bool bad = !plan.full_scans.empty() || !plan.error.empty();
+    if (bad) ++flagged;
+    os << (bad ? "FLAGGED " : "ok      ")
+       << std::chrono::duration<double, std::micro>(plan.time).count()
+       << "us " << plan.sql << "\n";
+    for (auto &detail : plan.details) os << "    " << detail << "\n";
+    for (auto &table : plan.full_scans) {
+      os << "    full scan of " << table << "\n";
+    }
+    if (!plan.error.empty()) os << "    error: " << plan.error << "\n";
+  }
+  return flagged;
+}
+
+// Appends rows made up values to table. Integer columns get values from 1 to
+// rows spread over the rows, so that they can be joined with the integer
+// primary keys of tables with as many rows. Integer primary keys are left to
+// sqlite.
+inline void fill_synthetic_rows(sqlite3 *sqldb, const std::string &table,
+                                std::int64_t rows) {
+  using namespace query_plan_detail;
+  std::string error;
+  auto info = prepare(sqldb, "PRAGMA table_info(\"" + table + "\")", error);
+  if (!info) throw std::runtime_error("sqlite error: " + error);
+  std::string columns;
+  std::string values;
+  std::string key;
+  while (sqlite3_step(info.get()) == SQLITE_ROW) {
+    std::string name =
+        reinterpret_cast<const char *>(sqlite3_column_text(info.get(), 1));
+    auto type_text =
+        reinterpret_cast<const char *>(sqlite3_column_text(info.get(), 2));
+    std::string type = type_text ? type_text : "";
+    std::transform(type.begin(), type.end(), type.begin(),
+                   [](unsigned char c) { return std::toupper(c); });
+    bool primary_key = sqlite3_column_int(info.get(), 5) != 0;
+    bool integer = type.find("INT") != type.npos;
+    if (primary_key && integer) {
+      key = name;
+      continue;
+    }
+    if (!columns.empty()) {
+      columns += ", ";
+      values += ", ";
+    }
+    columns += "\"" + name + "\"";
+    if (integer) {
+      values += "(i * 7919) % " + std::to_string(rows) + " + 1";
+    } else if (type.find("REAL") != type.npos ||
+               type.find("FLOA") != type.npos ||
+               type.find("DOUB") != type.npos) {
+      values += "(i % 1000) * 0.25";
+    } else {
+      values += "'v' || (i % 1000)";
+    }
+  }
+  if (columns.empty()) {
+    columns = "\"" + key + "\"";
+    values = "NULL";
+  }
+  auto sql = "WITH RECURSIVE seq(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM "
+             "seq WHERE i < " +
+             std::to_string(rows) + ") INSERT INTO \"" + table + "\"(" +
+             columns + ") SELECT " + values + " FROM seq;";
+  auto r = sqlite3_exec(sqldb, sql.c_str(), nullptr, nullptr, nullptr);
+  check_sqlite_return(r);
+}
+
 template <fixed_string S, typename T>
 decltype(auto) field(T &&t) {
   return skydown::sqlite_experimental::get<
@@ -641,10 +2542,27 @@ struct param_helper {
 
 }  // namespace sqlite_experimental
 
+using sqlite_experimental::batch_writer;
 using sqlite_experimental::bind;
+using sqlite_experimental::blob;
+using sqlite_experimental::blob_column;
+using sqlite_experimental::connection_pool;
+using sqlite_experimental::explain_queries;
 using sqlite_experimental::field;
+using sqlite_experimental::fill_synthetic_rows;
+using sqlite_experimental::nullable_column;
 using sqlite_experimental::prepared_statement;
+using sqlite_experimental::print_query_plans;
+using sqlite_experimental::query_plan;
+using sqlite_experimental::query_plan_options;
+using sqlite_experimental::query_registry;
+using sqlite_experimental::register_span_table;
+using sqlite_experimental::row_buffering;
+using sqlite_experimental::row_channel;
+using sqlite_experimental::statement_cache;
+using sqlite_experimental::text_column;
 using sqlite_experimental::to_concrete;
+using sqlite_experimental::transaction;
 
 namespace literals {
 
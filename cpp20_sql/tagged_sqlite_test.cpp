@@ -0,0 +1,834 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <gmock/gmock.h>
+
+#include <atomic>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+// The SQLite of the tests is built with SQLITE_ENABLE_COLUMN_METADATA.
+#define TAGGED_SQLITE_COLUMN_METADATA
+#include "tagged_sqlite.h"
+
+using namespace skydown::literals;
+
+// check_sqlite_return asserts before throwing in debug builds.
+#ifdef NDEBUG
+#define EXPECT_SQLITE_ERROR(statement) \
+  EXPECT_THROW(statement, std::runtime_error)
+#else
+#define EXPECT_SQLITE_ERROR(statement) EXPECT_DEATH(statement, "")
+#endif
+
+sqlite3 *open_memory_db() {
+  sqlite3 *sqldb = nullptr;
+  sqlite3_open(":memory:", &sqldb);
+  return sqldb;
+}
+
+void create_numbers(sqlite3 *sqldb, int count) {
+  skydown::prepared_statement<"CREATE TABLE numbers(value INTEGER NOT NULL);">{
+      sqldb}
+      .execute();
+  skydown::prepared_statement<
+      "INSERT INTO numbers(value) VALUES(?value:integer);">
+      insert{sqldb};
+  for (int i = 0; i < count; ++i) insert.execute("value"_param = i);
+}
+
+using count_numbers =
+    skydown::prepared_statement<"SELECT count(*) AS n:integer FROM numbers;">;
+
+TEST(TaggedSqlite, CloseWithoutStatementCache) {
+  auto sqldb = open_memory_db();
+  create_numbers(sqldb, 3);
+  EXPECT_THAT(count_numbers{sqldb}.execute_single_row().value()["n"_col], 3);
+  EXPECT_THAT(skydown::statement_cache::hits(sqldb), 0);
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, StatementCache) {
+  auto sqldb = open_memory_db();
+  skydown::statement_cache::enable(sqldb);
+  create_numbers(sqldb, 3);
+  {
+    count_numbers a{sqldb};
+    EXPECT_THAT(a.execute_single_row().value()["n"_col], 3);
+  }
+  auto misses = skydown::statement_cache::misses(sqldb);
+  {
+    count_numbers a{sqldb};
+    count_numbers b{sqldb};
+    EXPECT_THAT(a.execute_single_row().value()["n"_col], 3);
+    EXPECT_THAT(b.execute_single_row().value()["n"_col], 3);
+  }
+  EXPECT_THAT(skydown::statement_cache::hits(sqldb), 1);
+  EXPECT_THAT(skydown::statement_cache::misses(sqldb), misses + 1);
+
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_BUSY);
+  skydown::statement_cache::clear(sqldb);
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+int count_rows(sqlite3 *sqldb) {
+  return static_cast<int>(
+      count_numbers{sqldb}.execute_single_row().value()["n"_col]);
+}
+
+using insert_number = skydown::prepared_statement<
+    "INSERT INTO numbers(value) VALUES(?value:integer);">;
+
+TEST(TaggedSqlite, Transaction) {
+  auto sqldb = open_memory_db();
+  create_numbers(sqldb, 0);
+  {
+    skydown::transaction t(sqldb);
+    insert_number{sqldb}.execute("value"_param = 1);
+  }
+  EXPECT_THAT(count_rows(sqldb), 0);
+  {
+    skydown::transaction t(sqldb);
+    insert_number{sqldb}.execute("value"_param = 1);
+    t.commit();
+  }
+  EXPECT_THAT(count_rows(sqldb), 1);
+
+  using value_tuple = decltype(skydown::sqlite_experimental::tagged_tuple{
+      "value"_param = std::int64_t{}});
+  std::vector<value_tuple> rows;
+  for (std::int64_t i = 0; i < 10; ++i) {
+    rows.push_back(
+        skydown::sqlite_experimental::tagged_tuple{"value"_param = i});
+  }
+  insert_number{sqldb}.execute_many(rows);
+  EXPECT_THAT(count_rows(sqldb), 11);
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, BatchWriter) {
+  auto sqldb = open_memory_db();
+  create_numbers(sqldb, 0);
+  {
+    skydown::batch_writer<"INSERT INTO numbers(value) VALUES(?value:integer);">
+        writer{sqldb, 4, std::chrono::hours(1)};
+    for (int i = 0; i < 10; ++i) writer.write("value"_param = i);
+    writer.finish();
+  }
+  EXPECT_THAT(count_rows(sqldb), 10);
+  {
+    skydown::batch_writer<"INSERT INTO numbers(value) VALUES(?value:integer);">
+        writer{sqldb, 4, std::chrono::hours(1)};
+    for (int i = 0; i < 6; ++i) writer.write("value"_param = i);
+  }
+  // The last 2 rows were not committed.
+  EXPECT_THAT(count_rows(sqldb), 14);
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, BatchWriterMaxDelay) {
+  auto sqldb = open_memory_db();
+  create_numbers(sqldb, 0);
+  {
+    skydown::batch_writer<"INSERT INTO numbers(value) VALUES(?value:integer);">
+        writer{sqldb, 100, std::chrono::milliseconds(50)};
+    writer.write("value"_param = 1);
+    writer.flush_if_due();
+    EXPECT_THAT(sqlite3_get_autocommit(sqldb), 0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(60));
+    writer.flush_if_due();
+    EXPECT_THAT(sqlite3_get_autocommit(sqldb), 1);
+
+    writer.write("value"_param = 2);
+    writer.finish();
+    EXPECT_SQLITE_ERROR(writer.write("value"_param = 3));
+  }
+  EXPECT_THAT(count_rows(sqldb), 2);
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, BatchWriterFinishReportsFailedCommit) {
+  auto sqldb = open_memory_db();
+  sqlite3_exec(sqldb, "PRAGMA foreign_keys=ON", nullptr, nullptr, nullptr);
+  skydown::prepared_statement<"CREATE TABLE parents(id INTEGER PRIMARY KEY);">{
+      sqldb}
+      .execute();
+  skydown::prepared_statement<
+      "CREATE TABLE children(parent INTEGER REFERENCES parents(id) "
+      "DEFERRABLE INITIALLY DEFERRED);">{sqldb}
+      .execute();
+  {
+    skydown::batch_writer<
+        "INSERT INTO children(parent) VALUES(?parent:integer);">
+        writer{sqldb};
+    writer.write("parent"_param = 1);
+    EXPECT_SQLITE_ERROR(writer.finish());
+  }
+  EXPECT_THAT(sqlite3_get_autocommit(sqldb), 1);
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, StaticTextBindingAndRowView) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<"CREATE TABLE names(name TEXT, n INTEGER);">{
+      sqldb}
+      .execute();
+  {
+    skydown::prepared_statement<
+        "INSERT INTO names(name, n) VALUES(?name:text, ?n:integer);">
+        insert{sqldb};
+    for (int i = 0; i < 3; ++i) {
+      // The text is bound without a copy, and goes away after execute.
+      insert.execute("name"_param = "name" + std::to_string(i), "n"_param = i);
+    }
+  }
+  {
+    skydown::prepared_statement<
+        "SELECT name:text, n:integer FROM names WHERE name = ?name:text;">
+        select{sqldb};
+    std::string key = "name1";
+    std::int64_t n = 0;
+    EXPECT_TRUE(select.execute_single_row_view(
+        [&](auto &row) {
+          static_assert(
+              std::is_same_v<std::decay_t<decltype(row["name"_col])>,
+                             std::string_view>);
+          EXPECT_THAT(row["name"_col], "name1");
+          n = row["n"_col];
+        },
+        "name"_param = std::string_view(key)));
+    EXPECT_THAT(n, 1);
+    EXPECT_FALSE(select.execute_single_row_view([](auto &) {},
+                                                "name"_param = "missing"));
+
+    auto row = select.execute_single_row("name"_param = std::string("name2"));
+    ASSERT_TRUE(row.has_value());
+    EXPECT_THAT(row.value()["n"_col], 2);
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, RowReaderChecksColumnsOfOtherTypes) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<
+      "CREATE TABLE mixed(id INTEGER NOT NULL, n INTEGER, name TEXT, "
+      "m INTEGER NOT NULL);">{sqldb}
+      .execute();
+  // Without STRICT, NOT NULL columns can hold values of another type too.
+  sqlite3_exec(sqldb,
+               "INSERT INTO mixed VALUES(1, NULL, NULL, 1), "
+               "(2, 1.5, x'01', 2.5), (3, 3, 'c', 3);",
+               nullptr, nullptr, nullptr);
+  {
+    skydown::prepared_statement<
+        "SELECT id:integer, n:integer, name:text, m:integer FROM mixed "
+        "ORDER BY id;">
+        select{sqldb};
+    std::vector<std::tuple<std::int64_t, std::int64_t, std::string,
+                           std::int64_t>>
+        rows;
+    for (auto &row : select.execute_rows()) {
+      rows.emplace_back(row["id"_col], row["n"_col], row["name"_col],
+                        row["m"_col]);
+    }
+    // Values that are NULL or of another type are not converted.
+    EXPECT_THAT(rows, testing::ElementsAre(std::tuple(1, 0, "", 1),
+                                           std::tuple(2, 0, "", 0),
+                                           std::tuple(3, 3, "c", 3)));
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, RowReaderStrictTables) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<
+      "CREATE TABLE points(id INTEGER NOT NULL, x REAL NOT NULL, "
+      "name TEXT NOT NULL) STRICT;">{sqldb}
+      .execute();
+  sqlite3_exec(sqldb, "INSERT INTO points VALUES(1, 2, 'a'), (2, 0.5, 'b');",
+               nullptr, nullptr, nullptr);
+  {
+    // next.x is NULL for the last point, from the outer join.
+    skydown::prepared_statement<
+        "SELECT p.id AS id:integer, p.x AS x:real, p.name AS name:text, "
+        "next.x AS next_x:real FROM points p "
+        "LEFT JOIN points next ON next.id = p.id + 1 ORDER BY p.id;">
+        select{sqldb};
+    for (int i = 0; i < 2; ++i) {
+      std::vector<std::tuple<std::int64_t, double, std::string, double>> rows;
+      for (auto &row : select.execute_rows()) {
+        rows.emplace_back(row["id"_col], row["x"_col], row["name"_col],
+                          row["next_x"_col]);
+      }
+      EXPECT_THAT(rows, testing::ElementsAre(std::tuple(1, 2.0, "a", 0.5),
+                                             std::tuple(2, 0.5, "b", 0.0)));
+    }
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, ExecuteColumns) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<
+      "CREATE TABLE items(id INTEGER NOT NULL PRIMARY KEY, "
+      "name TEXT NOT NULL, price REAL NOT NULL, code TEXT);">{sqldb}
+      .execute();
+  {
+    skydown::prepared_statement<
+        "INSERT INTO items(name, price, code) "
+        "VALUES(?name:text, ?price:real, ?code:text?);">
+        insert{sqldb};
+    insert.execute("name"_param = "a", "price"_param = 1.5);
+    insert.execute("name"_param = "bcd", "price"_param = 2.5,
+                   "code"_param = "X");
+    insert.execute("name"_param = "ef", "price"_param = 0.5);
+
+    skydown::prepared_statement<
+        "SELECT id:integer, name:text, price:real, code:text? FROM items "
+        "WHERE price > ?min_price:real ORDER BY id;">
+        select{sqldb};
+    // The second call reuses the size of the first as a hint.
+    for (int i = 0; i < 2; ++i) {
+      auto columns = select.execute_columns("min_price"_param = 1.0);
+      EXPECT_THAT(columns["id"_col], testing::ElementsAre(1, 2));
+      ASSERT_THAT(columns["name"_col].size(), 2);
+      EXPECT_THAT(columns["name"_col][0], "a");
+      EXPECT_THAT(columns["name"_col][1], "bcd");
+      EXPECT_THAT(columns["price"_col], testing::ElementsAre(1.5, 2.5));
+      ASSERT_THAT(columns["code"_col].size(), 2);
+      EXPECT_THAT(columns["code"_col][0], std::nullopt);
+      EXPECT_THAT(columns["code"_col][1], "X");
+    }
+    auto empty = select.execute_columns("min_price"_param = 10.0);
+    EXPECT_THAT(empty["id"_col].size(), 0);
+    EXPECT_THAT(empty["name"_col].size(), 0);
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, SqlString) {
+  using skydown::sqlite_experimental::sql_string;
+  static_assert(sql_string<"SELECT id:integer, code:text? FROM t "
+                           "WHERE price > ?p:real;">
+                    .sv() == "SELECT id , code  FROM t WHERE price > ? ;");
+  static_assert(sql_string<"CREATE TABLE t(a TEXT);">.sv() ==
+                "CREATE TABLE t(a TEXT);");
+  // Annotations inside string literals are kept.
+  EXPECT_THAT(sql_string<"INSERT INTO t(a) VALUES(?a:text?, 'x:y');">.sv(),
+              "INSERT INTO t(a) VALUES(? , 'x:y');");
+}
+
+TEST(TaggedSqlite, ConnectionPool) {
+  auto path =
+      (std::filesystem::temp_directory_path() / "tagged_sqlite_test_pool.db")
+          .string();
+  std::filesystem::remove(path);
+  {
+    skydown::connection_pool pool(path, 4);
+    EXPECT_THAT(pool.size(), 4);
+    {
+      auto lease = pool.acquire();
+      lease.statement<"CREATE TABLE numbers(id INTEGER NOT NULL PRIMARY KEY, "
+                      "value INTEGER NOT NULL);">()
+          .execute();
+      skydown::transaction t(lease.get());
+      for (std::int64_t i = 1; i <= 100; ++i) {
+        lease.statement<"INSERT INTO numbers(value) VALUES(?value:integer);">()
+            .execute("value"_param = i);
+      }
+      t.commit();
+    }
+
+    std::atomic<std::int64_t> sum = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.emplace_back([&] {
+        for (std::int64_t id = 1; id <= 100; ++id) {
+          auto lease = pool.acquire();
+          lease
+              .statement<
+                  "SELECT value:integer FROM numbers WHERE id = ?id:integer;">()
+              .execute_single_row_view(
+                  [&](auto &row) { sum += row["value"_col]; }, "id"_param = id);
+        }
+      });
+    }
+    for (auto &t : threads) t.join();
+    EXPECT_THAT(sum.load(), 8 * 5050);
+
+    std::vector<skydown::connection_pool::lease> leases;
+    for (int i = 0; i < 4; ++i) leases.push_back(pool.acquire());
+    EXPECT_FALSE(pool.try_acquire().has_value());
+    leases.pop_back();
+    EXPECT_TRUE(pool.try_acquire().has_value());
+  }
+  std::filesystem::remove(path);
+  std::filesystem::remove(path + "-wal");
+  std::filesystem::remove(path + "-shm");
+}
+
+// Runs each task on its own thread.
+struct thread_executor {
+  std::vector<std::thread> threads;
+  void add(std::function<void()> f) { threads.emplace_back(std::move(f)); }
+  ~thread_executor() {
+    for (auto &t : threads) t.join();
+  }
+};
+
+using select_numbers = skydown::prepared_statement<
+    "SELECT value:integer FROM numbers WHERE value >= ?min:integer;">;
+
+TEST(TaggedSqlite, AsyncExecuteRows) {
+  auto sqldb = open_memory_db();
+  // More rows than async_channel_capacity, so that the producer blocks.
+  create_numbers(sqldb, 5000);
+  {
+    thread_executor executor;
+    select_numbers select{sqldb};
+    std::int64_t count = 0;
+    std::int64_t sum = 0;
+    for (auto &row : select.async_execute_rows(
+             executor, "min"_param = std::int64_t{0})) {
+      ++count;
+      sum += row["value"_col];
+    }
+    EXPECT_THAT(count, 5000);
+    EXPECT_THAT(sum, 4999 * 5000 / 2);
+
+    // Breaking out of the loop stops the scan, and the statement can be used
+    // again.
+    {
+      auto rows = select.async_execute_rows(executor,
+                                            "min"_param = std::int64_t{0});
+      count = 0;
+      for (auto &row : rows) {
+        (void)row;
+        if (++count == 5) break;
+      }
+    }
+    EXPECT_THAT(count, 5);
+    count = 0;
+    for (auto &row : select.async_execute_rows(
+             executor, "min"_param = std::int64_t{4990})) {
+      EXPECT_GE(row["value"_col], 4990);
+      ++count;
+    }
+    EXPECT_THAT(count, 10);
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+// Keeps the tasks until they are run by hand.
+struct deferred_executor {
+  std::vector<std::function<void()>> tasks;
+  void add(std::function<void()> f) { tasks.push_back(std::move(f)); }
+};
+
+TEST(TaggedSqlite, AsyncExecuteRowsTaskNeverStarted) {
+  auto sqldb = open_memory_db();
+  create_numbers(sqldb, 10);
+  {
+    deferred_executor executor;
+    select_numbers select{sqldb};
+    // Destroying the channel does not wait for a task that has not started.
+    select.async_execute_rows(executor, "min"_param = std::int64_t{0});
+    ASSERT_THAT(executor.tasks.size(), 1);
+
+    std::int64_t count = 0;
+    for (auto &row : select.execute_rows("min"_param = std::int64_t{5})) {
+      (void)row;
+      ++count;
+    }
+    EXPECT_THAT(count, 5);
+    // The task runs too late to use the statement.
+    executor.tasks[0]();
+    count = 0;
+    for (auto &row : select.execute_rows("min"_param = std::int64_t{8})) {
+      (void)row;
+      ++count;
+    }
+    EXPECT_THAT(count, 2);
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+using span_row = decltype(skydown::sqlite_experimental::tagged_tuple{
+    "id"_param = std::int64_t{}, "name"_param = std::string_view(),
+    "score"_param = 0.0, "note"_param = std::optional<std::string>()});
+
+template <skydown::sqlite_experimental::fixed_string Query>
+std::int64_t count_where(sqlite3 *sqldb) {
+  return skydown::prepared_statement<Query>{sqldb}
+      .execute_single_row()
+      .value()["c"_col];
+}
+
+// The span table has to filter the same rows as a regular table.
+#define EXPECT_SAME_ROWS(where)                                           \
+  EXPECT_THAT(                                                            \
+      (count_where<"SELECT count(*) AS c:integer FROM span WHERE " where  \
+                   ";">(sqldb)),                                          \
+      (count_where<"SELECT count(*) AS c:integer FROM copy WHERE " where  \
+                   ";">(sqldb)))                                          \
+      << where
+
+TEST(TaggedSqlite, SpanTable) {
+  std::vector<span_row> rows;
+  const char *names[] = {"d", "b", "a", "c", "e"};
+  for (int i = 0; i < 100; ++i) {
+    std::optional<std::string> note;
+    if (i % 3 == 0) note = "n" + std::to_string(i);
+    rows.push_back(span_row{"id"_param = std::int64_t{99 - i},
+                            "name"_param = std::string_view(names[i % 5]),
+                            "score"_param = i * 0.5,
+                            "note"_param = std::move(note)});
+  }
+
+  auto sqldb = open_memory_db();
+  skydown::register_span_table(sqldb, "span", std::span<const span_row>(rows));
+  skydown::prepared_statement<
+      "CREATE TABLE copy(id INTEGER, name TEXT, score REAL, note TEXT);">{sqldb}
+      .execute();
+  {
+    skydown::prepared_statement<
+        "INSERT INTO copy SELECT id, name, score, note FROM span;">{sqldb}
+        .execute();
+    EXPECT_THAT(count_where<"SELECT count(*) AS c:integer FROM copy;">(sqldb),
+                100);
+
+    EXPECT_SAME_ROWS("id = 5");
+    EXPECT_SAME_ROWS("id > 90");
+    EXPECT_SAME_ROWS("id >= 90");
+    EXPECT_SAME_ROWS("id < 10");
+    EXPECT_SAME_ROWS("id <= 10");
+    EXPECT_SAME_ROWS("id >= 10 AND id < 20");
+    EXPECT_SAME_ROWS("id > 9.5 AND id <= 19.9");
+    EXPECT_SAME_ROWS("id = '5'");
+    EXPECT_SAME_ROWS("id = 5.5");
+    EXPECT_SAME_ROWS("name = 'a'");
+    EXPECT_SAME_ROWS("name > 'c'");
+    EXPECT_SAME_ROWS("name >= 'c'");
+    EXPECT_SAME_ROWS("name < 'b'");
+    EXPECT_SAME_ROWS("name <= 'b'");
+    EXPECT_SAME_ROWS("name = 5");
+    EXPECT_SAME_ROWS("score > 2 AND score < 10");
+    EXPECT_SAME_ROWS("score = 4");
+    EXPECT_SAME_ROWS("note = 'n9'");
+    EXPECT_SAME_ROWS("note > 'n50'");
+    EXPECT_SAME_ROWS("note >= 'n51'");
+    EXPECT_SAME_ROWS("note < 'n30'");
+    EXPECT_SAME_ROWS("note <= 'n30'");
+    EXPECT_SAME_ROWS("note IS NULL");
+    EXPECT_SAME_ROWS("note IS NOT NULL");
+
+    skydown::prepared_statement<
+        "SELECT id:integer, note:text? FROM span "
+        "WHERE id >= ?min:integer AND id < ?max:integer ORDER BY id;">
+        select{sqldb};
+    std::vector<std::int64_t> ids;
+    for (auto &row : select.execute_rows("min"_param = std::int64_t{95},
+                                         "max"_param = std::int64_t{98})) {
+      ids.push_back(row["id"_col]);
+    }
+    EXPECT_THAT(ids, testing::ElementsAre(95, 96, 97));
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, ExecuteRowsBuffered) {
+  auto sqldb = open_memory_db();
+  create_numbers(sqldb, 1000);
+  {
+    select_numbers select{sqldb};
+    for (bool helper_thread : {false, true}) {
+      for (std::size_t buffered_rows : {1, 7, 256, 5000}) {
+        skydown::row_buffering buffering{buffered_rows, helper_thread};
+        std::int64_t count = 0;
+        std::int64_t sum = 0;
+        for (auto &row : select.execute_rows_buffered(
+                 buffering, "min"_param = std::int64_t{0})) {
+          ++count;
+          sum += row["value"_col];
+        }
+        EXPECT_THAT(count, 1000);
+        EXPECT_THAT(sum, 999 * 1000 / 2);
+
+        // Breaking out of the loop leaves the statement usable.
+        {
+          auto rows = select.execute_rows_buffered(
+              buffering, "min"_param = std::int64_t{0});
+          count = 0;
+          for (auto &row : rows) {
+            (void)row;
+            if (++count == 3) break;
+          }
+        }
+        EXPECT_THAT(count, 3);
+      }
+    }
+    std::int64_t count = 0;
+    for (auto &row : select.execute_rows("min"_param = std::int64_t{990})) {
+      (void)row;
+      ++count;
+    }
+    EXPECT_THAT(count, 10);
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+const skydown::query_plan *find_plan(
+    const std::vector<skydown::query_plan> &plans, std::string_view sql) {
+  for (auto &plan : plans) {
+    if (plan.sql == sql) return &plan;
+  }
+  return nullptr;
+}
+
+// Only instantiated, which registers the query.
+void aliased_join(sqlite3 *sqldb) {
+  skydown::prepared_statement<
+      "SELECT a.value AS value:integer FROM numbers AS a "
+      "JOIN numbers b ON b.value = a.value + 1 WHERE a.value >= ?min:integer;">
+      select{sqldb};
+}
+
+TEST(TaggedSqlite, QueryPlans) {
+  constexpr auto select_sql =
+      skydown::sqlite_experimental::sql_string<
+          "SELECT value:integer FROM numbers WHERE value >= ?min:integer;">
+          .sv();
+  auto queries = skydown::query_registry::queries();
+  EXPECT_THAT(queries, testing::Contains(select_sql));
+
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<"CREATE TABLE numbers(value INTEGER NOT NULL);">{
+      sqldb}
+      .execute();
+  skydown::fill_synthetic_rows(sqldb, "numbers", 2000);
+  EXPECT_THAT(count_rows(sqldb), 2000);
+
+  skydown::query_plan_options options;
+  options.min_scan_rows = 1000;
+  options.repetitions = 1;
+  auto plans = skydown::explain_queries(sqldb, options);
+  auto plan = find_plan(plans, select_sql);
+  ASSERT_NE(plan, nullptr);
+  EXPECT_THAT(plan->error, "");
+  EXPECT_THAT(plan->full_scans, testing::ElementsAre("numbers"));
+  // Scans are reported by alias, and flagged by the table.
+  constexpr auto join_sql =
+      skydown::sqlite_experimental::sql_string<
+          "SELECT a.value AS value:integer FROM numbers AS a "
+          "JOIN numbers b ON b.value = a.value + 1 "
+          "WHERE a.value >= ?min:integer;">
+          .sv();
+  auto join_plan = find_plan(plans, join_sql);
+  ASSERT_NE(join_plan, nullptr);
+  EXPECT_THAT(join_plan->full_scans, testing::Contains("numbers"));
+
+  sqlite3_exec(sqldb, "CREATE INDEX numbers_value ON numbers(value)", nullptr,
+               nullptr, nullptr);
+  plans = skydown::explain_queries(sqldb, options);
+  plan = find_plan(plans, select_sql);
+  ASSERT_NE(plan, nullptr);
+  EXPECT_THAT(plan->full_scans, testing::IsEmpty());
+  join_plan = find_plan(plans, join_sql);
+  ASSERT_NE(join_plan, nullptr);
+  EXPECT_THAT(join_plan->full_scans, testing::IsEmpty());
+
+  // Statements are timed with sample parameters that match synthetic rows.
+  for (auto &query : skydown::query_registry::entries()) {
+    if (query.sql != select_sql) continue;
+    sqlite3_stmt *stmt = nullptr;
+    ASSERT_THAT(sqlite3_prepare_v2(sqldb, query.sql.data(),
+                                   static_cast<int>(query.sql.size()), &stmt,
+                                   nullptr),
+                SQLITE_OK);
+    query.bind_samples(stmt);
+    EXPECT_THAT(sqlite3_step(stmt), SQLITE_ROW);
+    sqlite3_finalize(stmt);
+  }
+
+  // Queries on tables this database does not have get an error.
+  std::ostringstream os;
+  EXPECT_GT(skydown::print_query_plans(os, plans), 0);
+  EXPECT_THAT(os.str(), testing::HasSubstr("error: no such table"));
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, QueryPlanNames) {
+  using namespace skydown::sqlite_experimental::query_plan_detail;
+  EXPECT_THAT(scanned_name("SCAN o"), "o");
+  EXPECT_THAT(scanned_name("SCAN TABLE orders AS o"), "orders");
+  EXPECT_THAT(scanned_name("SCAN o USING COVERING INDEX i"), "o");
+  EXPECT_THAT(scanned_name("SCAN (subquery-1)"), std::nullopt);
+  EXPECT_THAT(scanned_name("SCAN SUBQUERY 1"), std::nullopt);
+  EXPECT_THAT(scanned_name("SCAN CONSTANT ROW"), std::nullopt);
+  EXPECT_THAT(scanned_name("SEARCH o USING INTEGER PRIMARY KEY (rowid=?)"),
+              std::nullopt);
+
+  auto names = from_names(
+      "WITH recent(id) AS (SELECT id FROM main.orders LIMIT 10) "
+      "SELECT c.name FROM \"customers\" AS c JOIN orders o ON o.id = c.id, "
+      "recent, (SELECT 1) sub, json_each('[]') AS j WHERE c.name = 'FROM x y'");
+  EXPECT_THAT(names,
+              testing::UnorderedElementsAre(
+                  testing::Pair("recent", ""), testing::Pair("c", "customers"),
+                  testing::Pair("o", "orders"), testing::Pair("sub", ""),
+                  testing::Pair("j", "")));
+}
+
+std::vector<std::byte> make_bytes(std::size_t size) {
+  std::vector<std::byte> bytes(size);
+  for (std::size_t i = 0; i < size; ++i) bytes[i] = std::byte(i % 251);
+  return bytes;
+}
+
+TEST(TaggedSqlite, BlobColumns) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<
+      "CREATE TABLE files(id INTEGER NOT NULL PRIMARY KEY, "
+      "data BLOB NOT NULL, thumb BLOB);">{sqldb}
+      .execute();
+  auto payload = make_bytes(1000);
+  {
+    skydown::prepared_statement<
+        "INSERT INTO files(data, thumb) VALUES(?data:blob, ?thumb:blob?);">
+        insert{sqldb};
+    insert.execute("data"_param = std::span<const std::byte>(payload));
+    insert.execute("data"_param = payload,
+                   "thumb"_param =
+                       std::span<const std::byte>(payload).first(3));
+    // An empty blob is not NULL.
+    insert.execute("data"_param = std::span<const std::byte>());
+
+    skydown::prepared_statement<
+        "SELECT id:integer, data:blob, thumb:blob? FROM files ORDER BY id;">
+        select{sqldb};
+    std::vector<std::vector<std::byte>> data;
+    std::vector<std::optional<std::size_t>> thumb_sizes;
+    for (auto &row : select.execute_rows()) {
+      data.emplace_back(row["data"_col].begin(), row["data"_col].end());
+      auto &thumb = row["thumb"_col];
+      thumb_sizes.push_back(thumb ? std::optional(thumb->size())
+                                  : std::nullopt);
+    }
+    EXPECT_THAT(data, testing::ElementsAre(payload, payload,
+                                           std::vector<std::byte>()));
+    EXPECT_THAT(thumb_sizes,
+                testing::ElementsAre(std::nullopt, 3, std::nullopt));
+
+    auto row = skydown::prepared_statement<
+                   "SELECT data:blob FROM files WHERE id = 2;">{sqldb}
+                   .execute_single_row();
+    ASSERT_TRUE(row.has_value());
+    EXPECT_THAT(row.value()["data"_col], payload);
+
+    auto columns = select.execute_columns();
+    ASSERT_THAT(columns["data"_col].size(), 3);
+    EXPECT_THAT(columns["data"_col][1].size(), 1000);
+    EXPECT_THAT(columns["data"_col][2].size(), 0);
+    EXPECT_THAT(columns["thumb"_col][1]->size(), 3);
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, BlobIncrementalIo) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<
+      "CREATE TABLE files(id INTEGER NOT NULL PRIMARY KEY, "
+      "data BLOB NOT NULL);">{sqldb}
+      .execute();
+  {
+    skydown::prepared_statement<
+        "INSERT INTO files(data) VALUES(zeroblob(?size:integer));">
+        insert{sqldb};
+    insert.execute("size"_param = std::int64_t{1 << 20});
+    insert.execute("size"_param = std::int64_t{10});
+  }
+  auto payload = make_bytes(4096);
+  {
+    skydown::blob b(sqldb, "files", "data", 1, true);
+    EXPECT_THAT(b.size(), 1 << 20);
+    for (std::size_t offset = 0; offset < b.size(); offset += payload.size()) {
+      b.write(payload, offset);
+    }
+    std::vector<std::byte> back(payload.size());
+    b.read(back, 100 * payload.size());
+    EXPECT_THAT(back, payload);
+    // An offset that does not fit in int is not truncated to 0.
+    EXPECT_SQLITE_ERROR(b.read(back, std::size_t{1} << 32));
+    b.reopen(2);
+    EXPECT_THAT(b.size(), 10);
+  }
+  {
+    auto row = skydown::prepared_statement<
+                   "SELECT data:blob FROM files WHERE id = 1;">{sqldb}
+                   .execute_single_row();
+    ASSERT_TRUE(row.has_value());
+    auto &data = row.value()["data"_col];
+    ASSERT_THAT(data.size(), 1 << 20);
+    EXPECT_TRUE(std::equal(payload.begin(), payload.end(),
+                           data.begin() + 7 * payload.size()));
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+TEST(TaggedSqlite, BindParametersDirectly) {
+  auto sqldb = open_memory_db();
+  skydown::prepared_statement<
+      "CREATE TABLE orders(item TEXT NOT NULL, price REAL NOT NULL, "
+      "code TEXT);">{sqldb}
+      .execute();
+  {
+    skydown::prepared_statement<
+        "INSERT INTO orders(item, price, code) "
+        "VALUES(?item:text, ?price:real, ?code:text?);">
+        insert{sqldb};
+    // Arguments can come in any order, and are converted to the type of the
+    // parameter.
+    insert.execute("code"_param = "A", "price"_param = 2,
+                   "item"_param = "phone");
+    // A missing optional parameter is NULL, also after it was bound before.
+    insert.execute("item"_param = std::string("laptop"), "price"_param = 1.5);
+    std::string_view item = "tablet";
+    insert.execute("price"_param = 3.25f, "item"_param = item,
+                   "code"_param = std::optional<std::string>());
+
+    skydown::prepared_statement<
+        "SELECT item:text, price:real, code:text? FROM orders "
+        "WHERE price >= ?min_price:real ORDER BY price;">
+        select{sqldb};
+    std::vector<std::tuple<std::string, double, std::optional<std::string>>>
+        rows;
+    for (auto &row : select.execute_rows("min_price"_param = 1)) {
+      rows.emplace_back(row["item"_col], row["price"_col], row["code"_col]);
+    }
+    EXPECT_THAT(rows,
+                testing::ElementsAre(
+                    std::tuple("laptop", 1.5, std::nullopt),
+                    std::tuple("phone", 2.0, std::optional<std::string>("A")),
+                    std::tuple("tablet", 3.25, std::nullopt)));
+  }
+  EXPECT_THAT(sqlite3_close(sqldb), SQLITE_OK);
+}
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -1,6 +1,17 @@
 #include "polymorphic.hpp"
+#include "../polymorphism/regular_polymorphism/shapes_interface.hpp"
 #include <benchmark/benchmark.h>
+#include <algorithm>
+#include <array>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <random>
+#include <span>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
 
 #ifdef _MSC_VER
 #pragma comment(lib,"shlwapi.lib")
@@ -58,6 +69,17 @@ static void BM_PolyRef(benchmark::State& state) {
 	static_assert(sizeof(ref) == 3 * sizeof(void*));
 }
 
+static void BM_PolyInlineRef(benchmark::State& state) {
+	Dummy d;
+	polymorphic::inline_ref<int(draw)> ref(d);
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		benchmark::DoNotOptimize(ref.call<draw>());
+	}
+	static_assert(sizeof(ref) == 2 * sizeof(void*));
+}
+
 static void BM_PolyObject(benchmark::State& state) {
 	Dummy d;
 	polymorphic::object<int(draw)> ref(d);
@@ -66,7 +88,7 @@ static void BM_PolyObject(benchmark::State& state) {
 		// This code gets timed
 		benchmark::DoNotOptimize(ref.call<draw>());
 	}
-	static_assert(sizeof(ref) == 4 * sizeof(void*));
+	static_assert(sizeof(ref) == 3 * sizeof(void*));
 }
 
 static void BM_PolyObjectVector(benchmark::State& state) {
@@ -83,6 +105,88 @@ static void BM_PolyObjectVector(benchmark::State& state) {
 	}
 }
 
+static void BM_PolyCollection(benchmark::State& state) {
+	polymorphic::poly_collection<int(draw)> objects;
+	for (int i:GetRandVector()) {
+		if (i % 2) {
+			objects.insert(Dummy{});
+		}
+		else {
+			objects.insert(int{});
+		}
+	}
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		objects.for_each_call<draw>();
+	}
+}
+
+// Particle<true> has a batch overload of draw, Particle<false> only the scalar one.
+template <bool Batch>
+struct Particle { float x = 1; float y = 2; };
+
+template <bool Batch>
+int poly_extend(draw, Particle<Batch>& p) { return static_cast<int>(p.x * p.x + p.y * p.y); }
+
+void poly_extend(draw, std::span<Particle<true>> particles, std::span<int> out) {
+	for (std::size_t i = 0; i < particles.size(); ++i) {
+		out[i] = static_cast<int>(particles[i].x * particles[i].x + particles[i].y * particles[i].y);
+	}
+}
+
+template <bool Batch>
+static void BM_PolyCollectionCallBatch(benchmark::State& state) {
+	polymorphic::poly_collection<int(draw)> objects;
+	for (int i = 0; i < 10000; ++i) {
+		if (i % 2) {
+			objects.insert(Particle<Batch>{});
+		}
+		else {
+			objects.insert(int{});
+		}
+	}
+	std::vector<int> out(objects.size());
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		objects.call_batch<draw>(std::span<int>(out));
+		benchmark::DoNotOptimize(out.data());
+	}
+	state.SetItemsProcessed(state.iterations() * objects.size());
+}
+
+int poly_extend(draw, std::string& s) { return static_cast<int>(s.size()); }
+
+template <typename Object>
+std::vector<Object> GetStringObjects() {
+	std::vector<Object> objects;
+	for (int i:GetRandVector()) {
+		objects.emplace_back(std::string(32, static_cast<char>('a' + i % 26)));
+	}
+	return objects;
+}
+
+static void BM_PolyObjectVectorCopy(benchmark::State& state) {
+	auto objects = GetStringObjects<polymorphic::object<int(draw)>>();
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		auto copy = objects;
+		benchmark::DoNotOptimize(copy.data());
+	}
+}
+
+static void BM_CowObjectVectorCopy(benchmark::State& state) {
+	auto objects = GetStringObjects<polymorphic::cow_object<int(draw)>>();
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		auto copy = objects;
+		benchmark::DoNotOptimize(copy.data());
+	}
+}
+
 static void BM_PolyRefVector(benchmark::State& state) {
 	std::vector<polymorphic::object<int(draw)>> objects;
 	for (int i:GetRandVector()) {
@@ -99,6 +203,22 @@ static void BM_PolyRefVector(benchmark::State& state) {
 	}
 }
 
+static void BM_PolyInlineRefVector(benchmark::State& state) {
+	std::vector<polymorphic::object<int(draw)>> objects;
+	for (int i:GetRandVector()) {
+		objects.push_back(GetObjectRand(i));
+	}
+
+	std::vector<polymorphic::inline_ref<int(draw)>> refs(objects.begin(), objects.end());
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		for (auto& r : refs) {
+			benchmark::DoNotOptimize(r.call<draw>());
+		}
+	}
+}
+
 static void BM_Function(benchmark::State& state) {
 	auto f = GetFunction();
 	// Perform setup here
@@ -144,18 +264,366 @@ static void BM_NonVirtualVector(benchmark::State& state) {
 		}
 	}
 }
+// Double dispatch over a closed set of shapes.
+class collide {};
+
+struct Circle;
+struct Square;
+struct Triangle;
+
+struct ShapeVisitor {
+	virtual int collide_with(const Circle&) const = 0;
+	virtual int collide_with(const Square&) const = 0;
+	virtual int collide_with(const Triangle&) const = 0;
+	virtual ~ShapeVisitor() {}
+};
+
+struct ShapeBase :ShapeVisitor {
+	virtual int collide(const ShapeBase& other) const = 0;
+};
+
+template <typename Derived, int Id>
+struct ShapeImpl :ShapeBase {
+	static constexpr int id = Id;
+	int collide(const ShapeBase& other) const override {
+		return other.collide_with(static_cast<const Derived&>(*this));
+	}
+	int collide_with(const Circle&) const override;
+	int collide_with(const Square&) const override;
+	int collide_with(const Triangle&) const override;
+};
+
+struct Circle :ShapeImpl<Circle, 1> {};
+struct Square :ShapeImpl<Square, 2> {};
+struct Triangle :ShapeImpl<Triangle, 3> {};
+
+template <typename A, typename B>
+int poly_extend(collide, const A&, const B&) { return A::id * 4 + B::id; }
+
+template <typename Derived, int Id>
+int ShapeImpl<Derived, Id>::collide_with(const Circle& c) const {
+	return poly_extend(::collide{}, c, static_cast<const Derived&>(*this));
+}
+template <typename Derived, int Id>
+int ShapeImpl<Derived, Id>::collide_with(const Square& s) const {
+	return poly_extend(::collide{}, s, static_cast<const Derived&>(*this));
+}
+template <typename Derived, int Id>
+int ShapeImpl<Derived, Id>::collide_with(const Triangle& t) const {
+	return poly_extend(::collide{}, t, static_cast<const Derived&>(*this));
+}
+
+using shape_types = polymorphic::type_list<Circle, Square, Triangle>;
+using shape_object = polymorphic::object<std::size_t(polymorphic::type_index<shape_types>) const>;
+using shape_variant = std::variant<Circle, Square, Triangle>;
+
+template <typename F>
+auto MakeShape(int i, F f) {
+	switch (i % 3) {
+	case 0: return f(Circle{});
+	case 1: return f(Square{});
+	default: return f(Triangle{});
+	}
+}
+
+static void BM_Dispatch2(benchmark::State& state) {
+	std::vector<shape_object> shapes;
+	for (int i:GetRandVector()) {
+		shapes.push_back(MakeShape(i, [](auto s) { return shape_object(s); }));
+	}
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		for (std::size_t i = 1; i < shapes.size(); ++i) {
+			benchmark::DoNotOptimize(polymorphic::dispatch2<collide>(shapes[i - 1], shapes[i]));
+		}
+	}
+}
+
+static void BM_Dispatch2Visit(benchmark::State& state) {
+	std::vector<shape_variant> shapes;
+	for (int i:GetRandVector()) {
+		shapes.push_back(MakeShape(i, [](auto s) { return shape_variant(s); }));
+	}
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		for (std::size_t i = 1; i < shapes.size(); ++i) {
+			benchmark::DoNotOptimize(std::visit([](const auto& a, const auto& b) {
+				return poly_extend(collide{}, a, b);
+				}, shapes[i - 1], shapes[i]));
+		}
+	}
+}
+
+static void BM_Dispatch2Virtual(benchmark::State& state) {
+	std::vector<std::unique_ptr<ShapeBase>> shapes;
+	for (int i:GetRandVector()) {
+		shapes.push_back(MakeShape(i, [](auto s) {
+			return std::unique_ptr<ShapeBase>(std::make_unique<decltype(s)>(s));
+			}));
+	}
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		for (std::size_t i = 1; i < shapes.size(); ++i) {
+			benchmark::DoNotOptimize(shapes[i]->collide(*shapes[i - 1]));
+		}
+	}
+}
+
+// Many threads reading the same rarely changed value.
+struct Config { int value = 1; };
+int poly_extend(draw, const Config& c) { return c.value; }
+
+int MaxBenchmarkThreads() {
+	return static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+}
+
+polymorphic::object<int(draw) const> shared_config{ Config{} };
+polymorphic::atomic_shared<int(draw) const> atomic_config{ Config{} };
+
+static void BM_SharedObjectCopyThreads(benchmark::State& state) {
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		auto config = shared_config;
+		benchmark::DoNotOptimize(config.call<draw>());
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+static void BM_AtomicSharedReadThreads(benchmark::State& state) {
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		benchmark::DoNotOptimize(atomic_config.call<draw>());
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+
+// Dispatch sweep over element count, number of concrete types and access pattern.
+// Arguments are {elements, types, pattern} where pattern is one of dispatch_pattern.
+// Cache misses can be added with --benchmark_perf_counters=CYCLES,CACHE-MISSES when
+// Google Benchmark is built with libpfm.
+constexpr int max_dispatch_types = 64;
+
+enum dispatch_pattern { sorted_kinds, random_kinds, clustered_kinds };
+
+std::vector<int> GetKinds(std::int64_t elements, int types, dispatch_pattern pattern) {
+	std::mt19937 gen(42);
+	std::uniform_int_distribution<int> kind(0, types - 1);
+	std::vector<int> kinds;
+	kinds.reserve(static_cast<std::size_t>(elements));
+	for (std::int64_t i = 0; i < elements; ++i) {
+		switch (pattern) {
+		case sorted_kinds: kinds.push_back(static_cast<int>(i * types / elements)); break;
+		case random_kinds: kinds.push_back(kind(gen)); break;
+		case clustered_kinds: kinds.push_back(i % 16 ? kinds.back() : kind(gen)); break;
+		}
+	}
+	return kinds;
+}
+
+template <int N>
+struct Kind {};
+
+template <int N>
+int poly_extend(draw, Kind<N>&) { return N; }
+
+template <int N>
+struct VirtualKind :Base {
+	int draw() override { return N; }
+};
+
+int shape_sink = 0;
+
+template <int N>
+struct ShapeKind {
+	void draw() const { shape_sink += N; }
+};
+
+template <typename Make, std::size_t... I>
+auto MakeKindTable(std::index_sequence<I...>) {
+	return std::array{ &Make::template make<I>... };
+}
+
+template <typename Make>
+auto MakeElements(const std::vector<int>& kinds) {
+	static const auto table = MakeKindTable<Make>(std::make_index_sequence<max_dispatch_types>{});
+	std::vector<decltype(table[0]())> elements;
+	elements.reserve(kinds.size());
+	for (int k : kinds) {
+		elements.push_back(table[k]());
+	}
+	return elements;
+}
+
+struct VirtualDispatch {
+	template <int N>
+	static std::unique_ptr<Base> make() { return std::make_unique<VirtualKind<N>>(); }
+	std::vector<std::unique_ptr<Base>> elements;
+	explicit VirtualDispatch(const std::vector<int>& kinds) :elements(MakeElements<VirtualDispatch>(kinds)) {}
+	void run() {
+		for (auto& e : elements) {
+			benchmark::DoNotOptimize(e->draw());
+		}
+	}
+};
+
+struct FunctionDispatch {
+	template <int N>
+	static std::function<int()> make() { return [] { return N; }; }
+	std::vector<std::function<int()>> elements;
+	explicit FunctionDispatch(const std::vector<int>& kinds) :elements(MakeElements<FunctionDispatch>(kinds)) {}
+	void run() {
+		for (auto& e : elements) {
+			benchmark::DoNotOptimize(e());
+		}
+	}
+};
+
+struct PolyObjectDispatch {
+	template <int N>
+	static polymorphic::object<int(draw)> make() { return polymorphic::object<int(draw)>(Kind<N>{}); }
+	std::vector<polymorphic::object<int(draw)>> elements;
+	explicit PolyObjectDispatch(const std::vector<int>& kinds) :elements(MakeElements<PolyObjectDispatch>(kinds)) {}
+	void run() {
+		for (auto& e : elements) {
+			benchmark::DoNotOptimize(e.call<draw>());
+		}
+	}
+};
+
+struct PolyRefDispatch {
+	PolyObjectDispatch objects;
+	std::vector<polymorphic::ref<int(draw)>> elements;
+	explicit PolyRefDispatch(const std::vector<int>& kinds)
+		:objects(kinds), elements(objects.elements.begin(), objects.elements.end()) {}
+	void run() {
+		for (auto& e : elements) {
+			benchmark::DoNotOptimize(e.call<draw>());
+		}
+	}
+};
+
+template <std::size_t... I>
+std::variant<Kind<I>...> MakeKindVariant(std::index_sequence<I...>);
+
+using kind_variant = decltype(MakeKindVariant(std::make_index_sequence<max_dispatch_types>{}));
+
+struct VariantDispatch {
+	template <int N>
+	static kind_variant make() { return Kind<N>{}; }
+	std::vector<kind_variant> elements;
+	explicit VariantDispatch(const std::vector<int>& kinds) :elements(MakeElements<VariantDispatch>(kinds)) {}
+	void run() {
+		for (auto& e : elements) {
+			benchmark::DoNotOptimize(std::visit([](auto& k) { return poly_extend(draw{}, k); }, e));
+		}
+	}
+};
+
+template <std::size_t... I>
+polymorphic::type_list<Kind<I>...> MakeKindTypeList(std::index_sequence<I...>);
+
+using kind_sealed_object = polymorphic::sealed_object<
+	decltype(MakeKindTypeList(std::make_index_sequence<max_dispatch_types>{})), int(draw)>;
+
+struct SealedObjectDispatch {
+	template <int N>
+	static kind_sealed_object make() { return Kind<N>{}; }
+	std::vector<kind_sealed_object> elements;
+	explicit SealedObjectDispatch(const std::vector<int>& kinds) :elements(MakeElements<SealedObjectDispatch>(kinds)) {}
+	void run() {
+		for (auto& e : elements) {
+			benchmark::DoNotOptimize(e.call<draw>());
+		}
+	}
+};
+
+struct ShapeDispatch {
+	template <int N>
+	static my_shapes::shape make() { return my_shapes::shape(ShapeKind<N>{}); }
+	std::vector<my_shapes::shape> elements;
+	explicit ShapeDispatch(const std::vector<int>& kinds) :elements(MakeElements<ShapeDispatch>(kinds)) {}
+	void run() {
+		for (auto& e : elements) {
+			e.draw();
+		}
+		benchmark::DoNotOptimize(shape_sink);
+	}
+};
+
+template <typename Dispatch>
+static void BM_Dispatch(benchmark::State& state) {
+	auto kinds = GetKinds(state.range(0), static_cast<int>(state.range(1)),
+		static_cast<dispatch_pattern>(state.range(2)));
+	Dispatch dispatch(kinds);
+	// Perform setup here
+	for (auto _ : state) {
+		// This code gets timed
+		dispatch.run();
+	}
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+	state.counters["time_per_call"] = benchmark::Counter(static_cast<double>(state.range(0)),
+		benchmark::Counter::kIsIterationInvariantRate | benchmark::Counter::kInvert);
+}
+
+// The full sweep has 126 configurations per dispatch and runs up to 1e7
+// elements, so it is only registered when POLYMORPHIC_DISPATCH_SWEEP is set.
+// Otherwise each pattern runs once with 10000 elements of 8 types.
+static void DispatchArguments(benchmark::internal::Benchmark* b) {
+	b->ArgNames({ "elements", "types", "pattern" });
+	if (!std::getenv("POLYMORPHIC_DISPATCH_SWEEP")) {
+		for (int pattern :{ sorted_kinds, random_kinds, clustered_kinds }) {
+			b->Args({ 10'000, 8, pattern });
+		}
+		return;
+	}
+	for (std::int64_t elements = 100; elements <= 10'000'000; elements *= 10) {
+		for (int types = 1; types <= max_dispatch_types; types *= 2) {
+			for (int pattern :{ sorted_kinds, random_kinds, clustered_kinds }) {
+				b->Args({ elements, types, pattern });
+			}
+		}
+	}
+}
+
 // Register the function as a benchmark
 BENCHMARK(BM_NonVirtual);
 BENCHMARK(BM_Virtual);
 BENCHMARK(BM_Function);
 BENCHMARK(BM_PolyRef);
+BENCHMARK(BM_PolyInlineRef);
 BENCHMARK(BM_PolyObject);
 
+BENCHMARK(BM_Dispatch2);
+BENCHMARK(BM_Dispatch2Visit);
+BENCHMARK(BM_Dispatch2Virtual);
+
 BENCHMARK(BM_NonVirtualVector);
 BENCHMARK(BM_VirtualVector);
 BENCHMARK(BM_FunctionVector);
 BENCHMARK(BM_PolyRefVector);
+BENCHMARK(BM_PolyInlineRefVector);
 BENCHMARK(BM_PolyObjectVector);
+BENCHMARK(BM_PolyCollection);
+BENCHMARK_TEMPLATE(BM_PolyCollectionCallBatch, true);
+BENCHMARK_TEMPLATE(BM_PolyCollectionCallBatch, false);
+BENCHMARK(BM_PolyObjectVectorCopy);
+BENCHMARK(BM_CowObjectVectorCopy);
+
+BENCHMARK(BM_SharedObjectCopyThreads)->ThreadRange(1, MaxBenchmarkThreads())->UseRealTime();
+BENCHMARK(BM_AtomicSharedReadThreads)->ThreadRange(1, MaxBenchmarkThreads())->UseRealTime();
+
+BENCHMARK_TEMPLATE(BM_Dispatch, VirtualDispatch)->Apply(DispatchArguments);
+BENCHMARK_TEMPLATE(BM_Dispatch, FunctionDispatch)->Apply(DispatchArguments);
+BENCHMARK_TEMPLATE(BM_Dispatch, PolyRefDispatch)->Apply(DispatchArguments);
+BENCHMARK_TEMPLATE(BM_Dispatch, PolyObjectDispatch)->Apply(DispatchArguments);
+BENCHMARK_TEMPLATE(BM_Dispatch, VariantDispatch)->Apply(DispatchArguments);
+BENCHMARK_TEMPLATE(BM_Dispatch, SealedObjectDispatch)->Apply(DispatchArguments);
+BENCHMARK_TEMPLATE(BM_Dispatch, ShapeDispatch)->Apply(DispatchArguments);
 
 
 BENCHMARK_MAIN();
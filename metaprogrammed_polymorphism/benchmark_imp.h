@@ -5,6 +5,7 @@ struct Dummy {};
 
 class draw {};
 int poly_extend(draw, Dummy&);
+int poly_extend(draw, int&);
 
 struct Base {
 	virtual int draw() = 0;
@@ -25,6 +25,14 @@ using entity = polymorphic::object<void(draw, std::ostream & os) const,
 	void(debug_draw, std::ostream & os) const,
 	void(update, my_time t)>;
 
+// Entities that only live for one frame, and are allocated from a per frame
+// arena.
+using frame_entity = polymorphic::basic_arena_object<
+	polymorphic::arena_destroy::non_trivial_only,
+	void(draw, std::ostream & os) const,
+	void(debug_draw, std::ostream & os) const,
+	void(update, my_time t)>;
+
 struct my_clock {
 	my_time time = 0;
 	void update(my_time t) { time = t; }
@@ -36,6 +44,9 @@ inline void poly_extend(draw, const my_clock& c, std::ostream& os) {
 
 inline void poly_extend(update, my_clock& c, my_time time) { c.update(time); }
 
+#include <array>
+#include <cstddef>
+#include <memory_resource>
 #include <string>
 #include <vector>
 
@@ -63,4 +74,18 @@ int main() {
 		draw_helper(e);
 		debug_draw_helper(e);
 	}
+	std::array<std::byte, 1024> frame_buffer;
+	for (my_time frame = 0; frame < 2; ++frame) {
+		// No heap allocations. Everything is released at the end of the frame.
+		std::pmr::monotonic_buffer_resource arena(frame_buffer.data(),
+			frame_buffer.size(), std::pmr::null_memory_resource());
+		std::pmr::vector<frame_entity> frame_entities(&arena);
+		frame_entities.reserve(2);
+		frame_entities.emplace_back(polymorphic::in_arena(arena, 5));
+		frame_entities.emplace_back(polymorphic::in_arena(arena, my_clock()));
+		for (auto& e : frame_entities) {
+			e.call<update>(frame);
+			e.call<draw>(std::cout);
+		}
+	}
 }
@@ -14,13 +14,111 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <cassert>
 #include <cstdint>
 #include <limits>
 #include <memory>
+#include <memory_resource>
+#include <new>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <variant>
+#include <vector>
+
+// Define POLYMORPHIC_PROFILE to count calls through refs, inline_refs,
+// objects and sealed_object per method, type and call site. See
+// polymorphic::profile. Profile builds change the vtable layout, so every
+// translation unit of a program has to agree on the macro. Everything is then
+// declared in an inline namespace, so mixing them fails to link.
+#ifdef POLYMORPHIC_PROFILE
+#include <algorithm>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#include <cstdlib>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#define POLYMORPHIC_PROFILE_NOINLINE __declspec(noinline)
+#define POLYMORPHIC_RETURN_ADDRESS() _ReturnAddress()
+#else
+#define POLYMORPHIC_PROFILE_NOINLINE __attribute__((noinline))
+#define POLYMORPHIC_RETURN_ADDRESS() __builtin_return_address(0)
+#endif
+// Calls are not inlined in profile builds, so that the return address
+// identifies the call site. Each copy of an unrolled loop body is its own
+// site, and tail calls are attributed to the caller of the caller.
+#define POLYMORPHIC_PROFILE_CALL(Method, type_info) \
+	::polymorphic::detail::profile_call(typeid(Method), type_info, POLYMORPHIC_RETURN_ADDRESS())
+#else
+#define POLYMORPHIC_PROFILE_NOINLINE
+#define POLYMORPHIC_PROFILE_CALL(Method, type_info)
+#endif
 
 namespace polymorphic {
+#ifdef POLYMORPHIC_PROFILE
+	inline namespace profile_build {
+#endif
+	template <typename... Types> struct type_list {};
+
+	// Method that returns the index of the type of the value in TypeList. The
+	// index is stored in the vtable instead of a trampoline. Refs and objects
+	// used with dispatch2 need the signature std::size_t(type_index<TypeList>) const.
+	template <typename TypeList> struct type_index {};
+
 	namespace detail {
+#ifdef POLYMORPHIC_PROFILE
+		struct profile_key {
+			const std::type_info* method;
+			const std::type_info* type;
+			const void* site;
+			bool operator==(const profile_key& other) const {
+				return *method == *other.method && *type == *other.type && site == other.site;
+			}
+		};
+
+		struct profile_key_hash {
+			std::size_t operator()(const profile_key& k) const {
+				auto h = k.method->hash_code() * 31 + k.type->hash_code();
+				return h * 31 + std::hash<const void*>{}(k.site);
+			}
+		};
+
+		struct profile_data {
+			std::mutex mutex;
+			std::unordered_map<profile_key, std::uint64_t, profile_key_hash> counts;
+		};
+
+		inline profile_data& get_profile_data() {
+			static profile_data data;
+			return data;
+		}
+
+		inline void profile_call(const std::type_info& method, const std::type_info& type,
+			const void* site) {
+			auto& data = get_profile_data();
+			std::lock_guard<std::mutex> lock(data.mutex);
+			++data.counts[profile_key{ &method, &type, site }];
+		}
+#endif
+
+		template <typename T, typename... Types>
+		constexpr std::size_t index_of() {
+			constexpr bool matches[] = { std::is_same_v<T, Types>... };
+			for (std::size_t i = 0; i < sizeof...(Types); ++i) {
+				if (matches[i]) return i;
+			}
+			return sizeof...(Types);
+		}
+
 
 		// We have a lot of intermediate functions. We want to make sure that we forward
 		// the parameters correctly. For non-reference parameters, we always move them.
@@ -56,26 +154,182 @@ namespace polymorphic {
 
 		using vtable_fun = ptr<void()>;
 
+		// The first lifetime_entry_count entries of every vtable are used by the
+		// holders to copy, move and destroy the value. The trampolines follow.
+		union vtable_entry {
+			constexpr vtable_entry(vtable_fun f) :fun(f) {}
+			constexpr vtable_entry(std::size_t v) :value(v) {}
+#ifdef POLYMORPHIC_PROFILE
+			constexpr vtable_entry(const std::type_info* t) :type_info(t) {}
+			const std::type_info* type_info;
+#endif
+			vtable_fun fun;
+			std::size_t value;
+		};
+
+		enum : std::size_t {
+			copy_entry, move_entry, destroy_entry, size_entry, alignment_entry,
+#ifdef POLYMORPHIC_PROFILE
+			type_info_entry,
+#endif
+			lifetime_entry_count
+		};
+
+		// copy is null if T is not copyable, move is null if T can throw when
+		// moved, and destroy is null if T is trivially destructible.
+		template <typename T>
+		struct lifetime {
+			static void copy(void* dest, const void* src) {
+				::new (dest) T(*static_cast<const T*>(src));
+			}
+			static void move(void* dest, void* src) noexcept {
+				::new (dest) T(std::move(*static_cast<T*>(src)));
+			}
+			static void destroy(void* t) noexcept { static_cast<T*>(t)->~T(); }
+
+			static vtable_fun copy_fun() {
+				if constexpr (std::is_copy_constructible_v<T>) {
+					return reinterpret_cast<vtable_fun>(copy);
+				}
+				else {
+					return nullptr;
+				}
+			}
+			static vtable_fun move_fun() {
+				if constexpr (std::is_nothrow_move_constructible_v<T>) {
+					return reinterpret_cast<vtable_fun>(move);
+				}
+				else {
+					return nullptr;
+				}
+			}
+			static vtable_fun destroy_fun() {
+				if constexpr (std::is_trivially_destructible_v<T>) {
+					return nullptr;
+				}
+				else {
+					return reinterpret_cast<vtable_fun>(destroy);
+				}
+			}
+		};
+
+		template <typename T, typename Signature>
+		struct vtable_entry_for {
+			static vtable_entry get() {
+				return reinterpret_cast<vtable_fun>(trampoline<T, Signature>::jump);
+			}
+		};
+
+		template <typename T, typename... Types>
+		struct vtable_entry_for<T, std::size_t(type_index<type_list<Types...>>) const> {
+			static vtable_entry get() {
+				constexpr auto index = index_of<T, Types...>();
+				static_assert(index < sizeof...(Types), "type is not in the type_list");
+				return index;
+			}
+		};
+
 		template <typename T, typename... Signatures>
-		inline const vtable_fun vtable[] = {
-			reinterpret_cast<vtable_fun>(trampoline<T, Signatures>::jump)... };
+		inline const vtable_entry vtable[] = {
+			lifetime<T>::copy_fun(), lifetime<T>::move_fun(), lifetime<T>::destroy_fun(),
+			sizeof(T), alignof(T),
+#ifdef POLYMORPHIC_PROFILE
+			&typeid(T),
+#endif
+			vtable_entry_for<T, Signatures>::get()... };
+
+		inline void* allocate_value(std::size_t size, std::size_t alignment) {
+			return ::operator new(size, std::align_val_t{ alignment });
+		}
+
+		inline void deallocate_value(void* p, std::size_t alignment) {
+			::operator delete(p, std::align_val_t{ alignment });
+		}
+
+		inline void copy_value(const vtable_entry* vt, void* dest, const void* src) {
+			reinterpret_cast<ptr<void(void*, const void*)>>(vt[copy_entry].fun)(dest, src);
+		}
+
+		inline void move_value(const vtable_entry* vt, void* dest, void* src) noexcept {
+			reinterpret_cast<ptr<void(void*, void*)>>(vt[move_entry].fun)(dest, src);
+		}
+
+		inline void destroy_value(const vtable_entry* vt, void* t) noexcept {
+			if (auto destroy = vt[destroy_entry].fun) {
+				reinterpret_cast<ptr<void(void*)>>(destroy)(t);
+			}
+		}
+
+		// Copies the value to memory from allocate_value.
+		inline void* clone_value(const vtable_entry* vt, const void* src) {
+			auto alignment = vt[alignment_entry].value;
+			void* p = allocate_value(vt[size_entry].value, alignment);
+			try {
+				copy_value(vt, p, src);
+			}
+			catch (...) {
+				deallocate_value(p, alignment);
+				throw;
+			}
+			return p;
+		}
+
+		inline void delete_value(const vtable_entry* vt, void* p) noexcept {
+			destroy_value(vt, p);
+			deallocate_value(p, vt[alignment_entry].value);
+		}
 
 		template <size_t I, typename Signature> struct vtable_caller;
 
 		template <size_t I, typename Method, typename Return, typename... Parameters>
 		struct vtable_caller<I, Return(Method, Parameters...)> {
-			decltype(auto) operator()(const vtable_fun* vt, const std::uint8_t* permutation, Method, void* t,
+			decltype(auto) operator()(const vtable_entry* vt, const std::uint8_t* permutation, Method, void* t,
 				Parameters... parameters) const {
-				return reinterpret_cast<ptr<Return(void*, Parameters...)>>(vt[permutation[I]])(
+				return reinterpret_cast<ptr<Return(void*, Parameters...)>>(vt[permutation[I]].fun)(
 					t, fwd<Parameters>(parameters)...);
 			}
 		};
 
 		template <std::size_t I, typename Method, typename Return, typename... Parameters>
 		struct vtable_caller<I, Return(Method, Parameters...) const> {
-			decltype(auto) operator()(const vtable_fun* vt, const std::uint8_t* permutation, Method, const void* t,
+			decltype(auto) operator()(const vtable_entry* vt, const std::uint8_t* permutation, Method, const void* t,
 				Parameters... parameters) const {
-				return reinterpret_cast<ptr<Return(const void*, Parameters...)>>(vt[permutation[I]])(t, fwd<Parameters>(parameters)...);
+				return reinterpret_cast<ptr<Return(const void*, Parameters...)>>(vt[permutation[I]].fun)(t, fwd<Parameters>(parameters)...);
+			}
+		};
+
+		template <std::size_t I, typename TypeList>
+		struct vtable_caller<I, std::size_t(type_index<TypeList>) const> {
+			std::size_t operator()(const vtable_entry* vt, const std::uint8_t* permutation,
+				type_index<TypeList>, const void*) const {
+				return vt[permutation[I]].value;
+			}
+		};
+
+		// Like vtable_caller, but for entries stored in signature order.
+		template <size_t I, typename Signature> struct inline_caller;
+
+		template <size_t I, typename Method, typename Return, typename... Parameters>
+		struct inline_caller<I, Return(Method, Parameters...)> {
+			decltype(auto) operator()(const vtable_entry* funs, Method, void* t,
+				Parameters... parameters) const {
+				return reinterpret_cast<ptr<Return(void*, Parameters...)>>(funs[I].fun)(
+					t, fwd<Parameters>(parameters)...);
+			}
+		};
+
+		template <std::size_t I, typename Method, typename Return, typename... Parameters>
+		struct inline_caller<I, Return(Method, Parameters...) const> {
+			decltype(auto) operator()(const vtable_entry* funs, Method, const void* t,
+				Parameters... parameters) const {
+				return reinterpret_cast<ptr<Return(const void*, Parameters...)>>(funs[I].fun)(t, fwd<Parameters>(parameters)...);
+			}
+		};
+
+		template <std::size_t I, typename TypeList>
+		struct inline_caller<I, std::size_t(type_index<TypeList>) const> {
+			std::size_t operator()(const vtable_entry* funs, type_index<TypeList>, const void*) const {
+				return funs[I].value;
 			}
 		};
 
@@ -85,135 +339,564 @@ namespace polymorphic {
 		struct is_const_signature<Return(Method, Parameters...) const>
 			: std::true_type {};
 
+		// Resolves a call the same way as vtable_caller, and returns whether the
+		// signature that was picked is const.
+		template <typename Signature> struct const_checker;
+
+		template <typename Method, typename Return, typename... Parameters>
+		struct const_checker<Return(Method, Parameters...)> {
+			std::false_type operator()(Method, void*, Parameters...) const;
+		};
+
+		template <typename Method, typename Return, typename... Parameters>
+		struct const_checker<Return(Method, Parameters...) const> {
+			std::true_type operator()(Method, const void*, Parameters...) const;
+		};
+
 		template <std::size_t I, typename Signature> struct index_getter {
 			constexpr int operator()(type<Signature>) const { return I; }
 		};
 
 		struct value_tag {};
 
+		// A value together with the memory resource it should be allocated from.
+		template <typename T>
+		struct arena_value {
+			std::pmr::memory_resource* resource;
+			T value;
+		};
+
+		template <typename T> struct is_arena_value :std::false_type {};
+		template <typename T> struct is_arena_value<arena_value<T>> :std::true_type {};
+
+		enum class arena_destroy { always, non_trivial_only };
+
+		template <arena_destroy Destroy>
+		class arena_holder;
+
+		// The type that the vtable is generated for when Holder is constructed
+		// from T. Only arena_holder unwraps an arena_value, every other holder
+		// would store the resource pointer together with the value.
+		template <typename Holder, typename T> struct stored_type {
+			static_assert(!is_arena_value<T>::value, "in_arena requires an arena_object");
+			using type = T;
+		};
+		template <arena_destroy Destroy, typename T>
+		struct stored_type<arena_holder<Destroy>, arena_value<T>> { using type = T; };
+
+		template <typename Holder, typename T>
+		using stored_type_t = typename stored_type<Holder, T>::type;
+
 		template <typename Holder, typename Sequence, typename... Signatures>
 		class ref_impl;
 
+		template <typename Holder, typename Sequence, typename... Signatures>
+		class inline_ref_impl;
+
 		template<typename T>
 		struct is_ref_impl :std::false_type {};
 
 		template <typename Holder, typename Sequence, typename... Signatures>
 		struct is_ref_impl<ref_impl<Holder, Sequence, Signatures...>> :std::true_type {};
 
+		// The vtable pointer and the holder. Holders that own the value are copied,
+		// moved and destroyed using the lifetime entries of the vtable. Refs stay
+		// trivially copyable.
+		template <typename Holder, bool = Holder::owns_value>
+		struct ref_storage {
+			const vtable_entry* vptr_;
+			Holder t_;
+
+			template <typename... Args>
+			ref_storage(const vtable_entry* vptr, Args&&... args)
+				:vptr_(vptr), t_(std::forward<Args>(args)...) {}
+		};
+
+		template <typename Holder>
+		struct ref_storage<Holder, true> {
+			const vtable_entry* vptr_;
+			Holder t_;
+
+			template <typename... Args>
+			ref_storage(const vtable_entry* vptr, Args&&... args)
+				:vptr_(vptr), t_(std::forward<Args>(args)...) {}
+
+			ref_storage(const ref_storage& other) :vptr_(other.vptr_), t_(other.t_, other.vptr_) {}
+			static_assert(std::is_nothrow_constructible_v<Holder, Holder&&, const vtable_entry*>,
+				"moving a holder must not throw");
+
+			ref_storage(ref_storage&& other)noexcept
+				:vptr_(other.vptr_), t_(std::move(other.t_), other.vptr_) {
+				other.vptr_ = nullptr;
+			}
+			ref_storage& operator=(const ref_storage& other) {
+				return (*this) = ref_storage(other);
+			}
+			// Moving a holder never throws, so the holder member is replaced in
+			// place after the held value is destroyed.
+			ref_storage& operator=(ref_storage&& other)noexcept {
+				if (this != &other) {
+					if (vptr_) t_.destroy(vptr_);
+					t_.~Holder();
+					::new (static_cast<void*>(std::addressof(t_))) Holder(std::move(other.t_), other.vptr_);
+					vptr_ = other.vptr_;
+					other.vptr_ = nullptr;
+				}
+				return *this;
+			}
+			~ref_storage() {
+				if (vptr_) t_.destroy(vptr_);
+			}
+		};
+
 		template <typename Holder, size_t... I, typename... Signatures>
-		class ref_impl<Holder, std::index_sequence<I...>, Signatures...> { 
+		class ref_impl<Holder, std::index_sequence<I...>, Signatures...> :ref_storage<Holder> {
 
 			template <typename OtherHolder, typename OtherSequence, typename... OtherSignatures>
 			friend class ref_impl;
 
-			const detail::vtable_fun* vptr_;
+			template <typename OtherHolder, typename OtherSequence, typename... OtherSignatures>
+			friend class inline_ref_impl;
+
+			using storage = ref_storage<Holder>;
+			using storage::vptr_;
+			using storage::t_;
 			std::array<std::uint8_t, sizeof...(Signatures)> permutation_;
-			Holder t_;
 
 			static constexpr overload<vtable_caller<I, Signatures>...> call_vtable{};
 			static constexpr overload<index_getter<I, Signatures>...> get_index{};
+			static constexpr overload<const_checker<Signatures>...> check_const{};
 
 			template <typename T>
 			ref_impl(T&& t, std::false_type)
-				: vptr_(&detail::vtable<std::decay_t<T>, Signatures...>[0]), permutation_{ I... },
-				t_(std::forward<T>(t), value_tag{}) {}
+				: storage(&detail::vtable<stored_type_t<Holder, std::decay_t<T>>, Signatures...>[0],
+					std::forward<T>(t), value_tag{}),
+				permutation_{ (lifetime_entry_count + I)... } {}
 
 			template <typename OtherRef>
 			ref_impl(OtherRef&& other, std::true_type)
-				: vptr_(other.vptr_), permutation_{ other.permutation_[other.get_index(type<Signatures>{})]... },
-				t_(std::forward<OtherRef>(other).t_) {
+				: storage(other.vptr_, std::forward<OtherRef>(other).t_, other.vptr_),
+				permutation_{ other.permutation_[other.get_index(type<Signatures>{})]... } {
+				// Moving the holder leaves other without a value.
+				if constexpr (Holder::owns_value && !std::is_lvalue_reference_v<OtherRef> &&
+					std::is_same_v<Holder, std::decay_t<decltype(other.t_)>>) {
+					other.vptr_ = nullptr;
+				}
+			}
+
+			template <typename Signature>
+			vtable_entry get_fun(type<Signature> s) const {
+				return vptr_[permutation_[get_index(s)]];
 			}
 
 		public:
 			template <typename T>
 			ref_impl(T&& t) :ref_impl(std::forward<T>(t), is_ref_impl<std::decay_t<T>>{}) {}
 
-			explicit operator bool() const { return t_ != nullptr; }
+			// False for objects that have been moved from.
+			explicit operator bool() const { return vptr_ != nullptr; }
+
+			auto get_ptr() const -> decltype(t_.get_ptr(vptr_)) {
+				return vptr_ ? t_.get_ptr(vptr_) : nullptr;
+			}
+			auto get_ptr() -> decltype(t_.get_ptr(vptr_)) {
+				return vptr_ ? t_.get_ptr(vptr_) : nullptr;
+			}
+
+			template <typename Method, typename... Parameters>
+			POLYMORPHIC_PROFILE_NOINLINE decltype(auto) call(Parameters&&... parameters) const {
+				POLYMORPHIC_PROFILE_CALL(Method, *vptr_[type_info_entry].type_info);
+				return call_vtable(vptr_, permutation_.data(), Method{}, t_.get_ptr(vptr_),
+					std::forward<Parameters>(parameters)...);
+			}
+
+			// Const signatures only get the const pointer from the holder, so that
+			// holders such as cow_holder do not have to unshare the value.
+			template <typename Method, typename... Parameters>
+			POLYMORPHIC_PROFILE_NOINLINE decltype(auto) call(Parameters&&... parameters) {
+				POLYMORPHIC_PROFILE_CALL(Method, *vptr_[type_info_entry].type_info);
+				using is_const_call = decltype(check_const(Method{}, std::declval<void*>(),
+					std::declval<Parameters>()...));
+				if constexpr (is_const_call::value) {
+					return call_vtable(vptr_, permutation_.data(), Method{}, std::as_const(t_).get_ptr(vptr_),
+						std::forward<Parameters>(parameters)...);
+				}
+				else {
+					return call_vtable(vptr_, permutation_.data(), Method{}, t_.get_ptr(vptr_),
+						std::forward<Parameters>(parameters)...);
+				}
+			}
+		};
+
+		template<typename T>
+		struct is_inline_ref_impl :std::false_type {};
+
+		template <typename Holder, typename Sequence, typename... Signatures>
+		struct is_inline_ref_impl<inline_ref_impl<Holder, Sequence, Signatures...>> :std::true_type {};
+
+		// Stores the trampolines directly instead of a vtable pointer and a
+		// permutation, saving two dependent loads per call.
+		template <typename Holder, size_t... I, typename... Signatures>
+		class inline_ref_impl<Holder, std::index_sequence<I...>, Signatures...> {
+
+			template <typename OtherHolder, typename OtherSequence, typename... OtherSignatures>
+			friend class inline_ref_impl;
+
+			std::array<vtable_entry, sizeof...(Signatures)> funs_;
+			Holder t_;
+#ifdef POLYMORPHIC_PROFILE
+			const std::type_info* type_info_ = nullptr;
+#endif
+
+			static constexpr overload<inline_caller<I, Signatures>...> call_funs{};
+			static constexpr overload<index_getter<I, Signatures>...> get_index{};
+
+			template <typename T>
+			inline_ref_impl(T&& t, std::false_type, std::false_type)
+				: funs_{ vtable_entry_for<stored_type_t<Holder, std::decay_t<T>>, Signatures>::get()... },
+				t_(std::forward<T>(t), value_tag{}) {
+#ifdef POLYMORPHIC_PROFILE
+				type_info_ = &typeid(stored_type_t<Holder, std::decay_t<T>>);
+#endif
+			}
+
+			template <typename OtherRef>
+			inline_ref_impl(OtherRef&& other, std::true_type, std::false_type)
+				: funs_{ other.get_fun(type<Signatures>{})... },
+				t_(std::forward<OtherRef>(other).t_, other.vptr_) {
+#ifdef POLYMORPHIC_PROFILE
+				type_info_ = other.vptr_[type_info_entry].type_info;
+#endif
+			}
+
+			template <typename OtherRef>
+			inline_ref_impl(OtherRef&& other, std::false_type, std::true_type)
+				: funs_{ other.funs_[other.get_index(type<Signatures>{})]... },
+				t_(std::forward<OtherRef>(other).t_) {
+#ifdef POLYMORPHIC_PROFILE
+				type_info_ = other.type_info_;
+#endif
+			}
+
+		public:
+			template <typename T>
+			inline_ref_impl(T&& t) :inline_ref_impl(std::forward<T>(t),
+				is_ref_impl<std::decay_t<T>>{}, is_inline_ref_impl<std::decay_t<T>>{}) {}
 
 			auto get_ptr() const { return t_.get_ptr(); }
 			auto get_ptr() { return t_.get_ptr(); }
 
 			template <typename Method, typename... Parameters>
-			decltype(auto) call(Parameters&&... parameters) const {
-				return call_vtable(vptr_, permutation_.data(), Method{}, t_.get_ptr(),
+			POLYMORPHIC_PROFILE_NOINLINE decltype(auto) call(Parameters&&... parameters) const {
+				POLYMORPHIC_PROFILE_CALL(Method, *type_info_);
+				return call_funs(funs_.data(), Method{}, t_.get_ptr(),
 					std::forward<Parameters>(parameters)...);
 			}
 
 			template <typename Method, typename... Parameters>
-			decltype(auto) call(Parameters&&... parameters) {
-				return call_vtable(vptr_, permutation_.data(), Method{}, t_.get_ptr(),
+			POLYMORPHIC_PROFILE_NOINLINE decltype(auto) call(Parameters&&... parameters) {
+				POLYMORPHIC_PROFILE_CALL(Method, *type_info_);
+				return call_funs(funs_.data(), Method{}, t_.get_ptr(),
 					std::forward<Parameters>(parameters)...);
 			}
 		};
 
-		struct holder_interface {
-			virtual std::unique_ptr<holder_interface> clone()const = 0;
-			virtual ~holder_interface() {}
-			void* ptr_ = nullptr;
-		};
-		template<typename T>
-		struct holder_impl :holder_interface {
-			holder_impl(T t) :t_(std::move(t)) { ptr_ = &t_; }
-			std::unique_ptr<holder_interface> clone() const override {
-				return std::make_unique<holder_impl<T>>(t_);
+		// Holders store the value for ref_impl. Holders that own the value are
+		// constructed from a value, or from another holder and its vtable, and
+		// are destroyed through destroy(vt).
+
+		// Stores types that fit in Size and Alignment, and can be moved without
+		// throwing, inside the object. Everything else goes on the heap.
+		template <std::size_t Size, std::size_t Alignment>
+		class value_holder {
+			static constexpr std::size_t storage_size = Size > sizeof(void*) ? Size : sizeof(void*);
+			static constexpr std::size_t storage_alignment =
+				Alignment > alignof(void*) ? Alignment : alignof(void*);
+
+			alignas(storage_alignment) unsigned char storage_[storage_size];
+
+			static bool is_inline(const vtable_entry* vt) {
+				return vt[size_entry].value <= Size && vt[alignment_entry].value <= Alignment &&
+					vt[move_entry].fun != nullptr;
+			}
+
+			void* heap_ptr() const { return *std::launder(reinterpret_cast<void* const*>(storage_)); }
+			void set_heap_ptr(void* p) { ::new (static_cast<void*>(storage_)) void* (p); }
+
+		public:
+			static constexpr bool owns_value = true;
+
+			template <typename T>
+			static constexpr bool fits_inline = sizeof(T) <= Size && alignof(T) <= Alignment &&
+				std::is_nothrow_move_constructible_v<T>;
+
+			template<typename T>
+			value_holder(T t, value_tag) {
+				static_assert(std::is_copy_constructible_v<T>, "object requires a copyable value");
+				if constexpr (fits_inline<T>) {
+					::new (static_cast<void*>(storage_)) T(std::move(t));
+				}
+				else {
+					void* p = allocate_value(sizeof(T), alignof(T));
+					try {
+						::new (p) T(std::move(t));
+					}
+					catch (...) {
+						deallocate_value(p, alignof(T));
+						throw;
+					}
+					set_heap_ptr(p);
+				}
+			}
+
+			value_holder(const value_holder& other, const vtable_entry* vt) {
+				if (!vt) return;
+				if (is_inline(vt)) {
+					copy_value(vt, storage_, other.storage_);
+				}
+				else {
+					set_heap_ptr(clone_value(vt, other.heap_ptr()));
+				}
+			}
+
+			// Only values on the heap can throw when moved, so this never throws
+			// or touches the heap.
+			value_holder(value_holder&& other, const vtable_entry* vt)noexcept {
+				if (!vt) return;
+				if (is_inline(vt)) {
+					move_value(vt, storage_, other.storage_);
+					destroy_value(vt, other.storage_);
+				}
+				else {
+					set_heap_ptr(other.heap_ptr());
+				}
+			}
+
+			void destroy(const vtable_entry* vt) noexcept {
+				if (is_inline(vt)) {
+					destroy_value(vt, storage_);
+				}
+				else {
+					delete_value(vt, heap_ptr());
+				}
+			}
+
+			void* get_ptr(const vtable_entry* vt) {
+				return is_inline(vt) ? storage_ : heap_ptr();
+			}
+			const void* get_ptr(const vtable_entry* vt)const {
+				return is_inline(vt) ? storage_ : heap_ptr();
 			}
-			T t_;
 		};
 
-		class value_holder {
-			std::unique_ptr<holder_interface> impl_;
+		// Allocates the value from a memory resource. Copies are allocated from
+		// the same resource. With arena_destroy::non_trivial_only, trivially
+		// destructible values are neither destroyed nor deallocated, and their
+		// memory is only reclaimed when the resource releases it. The default
+		// resource never does, so such holders only take in_arena values.
+		template <arena_destroy Destroy>
+		class arena_holder {
 			void* ptr_ = nullptr;
+			std::pmr::memory_resource* resource_ = nullptr;
+
 		public:
+			static constexpr bool owns_value = true;
+
 			template<typename T>
-			value_holder(T t, value_tag) :impl_(std::make_unique<holder_impl<T>>(std::move(t))), ptr_(get_ptr_impl()) {}
+			arena_holder(T t, value_tag)
+				:arena_holder(arena_value<T>{ std::pmr::get_default_resource(), std::move(t) }, value_tag{}) {
+				static_assert(Destroy == arena_destroy::always,
+					"arena_destroy::non_trivial_only requires an in_arena value");
+			}
 
-			value_holder(value_holder&& other)noexcept :impl_(std::move(other.impl_)), ptr_(other.ptr_) {
-				other.ptr_ = nullptr;
+			template<typename T>
+			arena_holder(arena_value<T> v, value_tag) :resource_(v.resource) {
+				static_assert(std::is_copy_constructible_v<T>, "object requires a copyable value");
+				void* p = resource_->allocate(sizeof(T), alignof(T));
+				try {
+					ptr_ = ::new (p) T(std::move(v.value));
+				}
+				catch (...) {
+					resource_->deallocate(p, sizeof(T), alignof(T));
+					throw;
+				}
 			}
-			value_holder& operator=(value_holder&& other)noexcept {
-				impl_ = std::move(other.impl_);
-				ptr_ = std::move(other.ptr_);
-				other.ptr_ = nullptr;
-				return *this;
+
+			arena_holder(const arena_holder& other, const vtable_entry* vt) :resource_(other.resource_) {
+				if (!vt) return;
+				auto size = vt[size_entry].value;
+				auto alignment = vt[alignment_entry].value;
+				void* p = resource_->allocate(size, alignment);
+				try {
+					copy_value(vt, p, other.ptr_);
+				}
+				catch (...) {
+					resource_->deallocate(p, size, alignment);
+					throw;
+				}
+				ptr_ = p;
 			}
 
-			value_holder(const value_holder& other) :impl_(other.impl_ ? other.impl_->clone() : nullptr), ptr_(get_ptr_impl()) {}
-			value_holder& operator=(const value_holder& other) {
-				return (*this) = value_holder(other);
+			arena_holder(arena_holder&& other, const vtable_entry*)noexcept
+				:ptr_(other.ptr_), resource_(other.resource_) {}
+
+			void destroy(const vtable_entry* vt) noexcept {
+				if (Destroy == arena_destroy::non_trivial_only && !vt[destroy_entry].fun) return;
+				destroy_value(vt, ptr_);
+				resource_->deallocate(ptr_, vt[size_entry].value, vt[alignment_entry].value);
 			}
-			void* get_ptr_impl() { return impl_ ? impl_->ptr_ : nullptr; }
-			void* get_ptr() { return ptr_; }
-			const void* get_ptr()const { return ptr_; }
 
-			auto clone_ptr()const { return impl_ ? impl_->clone() : nullptr; }
+			void* get_ptr(const vtable_entry*) { return ptr_; }
+			const void* get_ptr(const vtable_entry*)const { return ptr_; }
+
+			std::pmr::memory_resource* resource()const { return resource_; }
 		};
 
-		struct shared_ptr_holder {
-			std::shared_ptr<const holder_interface> impl_;
-			const void* ptr_ = nullptr;
-			const void* get_ptr()const { return ptr_; }
-			const void* get_ptr_impl()const { return impl_ ? impl_->ptr_ : nullptr; }
-			shared_ptr_holder(const shared_ptr_holder&) = default;
-			shared_ptr_holder& operator=(const shared_ptr_holder&) = default;
-			shared_ptr_holder(shared_ptr_holder&& other)noexcept :impl_(std::move(other.impl_)), ptr_(other.ptr_) {
-				other.ptr_ = nullptr;
-			}
-			shared_ptr_holder& operator=(shared_ptr_holder&& other)noexcept {
-				impl_ = std::move(other.impl_);
-				ptr_ = std::move(other.ptr_);
-				other.ptr_ = nullptr;
-				return *this;
+		// Copies share the value through a reference count stored in front of
+		// it. The value is cloned the first time a shared value is accessed
+		// through a non-const signature. Once a ref has been taken from a
+		// non-const object, the value is marked unshareable and later copies
+		// clone it right away. A ref taken from a const object points at the
+		// shared value, and is invalidated by the next non-const access to the
+		// object.
+		class cow_holder {
+			using count_type = std::atomic<std::size_t>;
+			static constexpr std::size_t unshareable = std::numeric_limits<std::size_t>::max();
+			void* ptr_ = nullptr;
+
+			static std::size_t node_alignment(std::size_t alignment) {
+				return alignment > alignof(count_type) ? alignment : alignof(count_type);
+			}
+			static std::size_t header_size(std::size_t alignment) {
+				auto a = node_alignment(alignment);
+				return (sizeof(count_type) + a - 1) / a * a;
+			}
+			count_type& count()const { return *(static_cast<count_type*>(ptr_) - 1); }
+
+			// Returns the location for the value, with the count set to 1.
+			static void* allocate_node(std::size_t size, std::size_t alignment) {
+				auto header = header_size(alignment);
+				auto node = static_cast<unsigned char*>(
+					allocate_value(header + size, node_alignment(alignment)));
+				::new (static_cast<void*>(node + header - sizeof(count_type))) count_type(1);
+				return node + header;
+			}
+			static void deallocate_node(void* p, std::size_t alignment) {
+				deallocate_value(static_cast<unsigned char*>(p) - header_size(alignment),
+					node_alignment(alignment));
+			}
+
+			void release(const vtable_entry* vt) noexcept {
+				if (count().load(std::memory_order_relaxed) == unshareable ||
+					count().fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					destroy_value(vt, ptr_);
+					deallocate_node(ptr_, vt[alignment_entry].value);
+				}
+			}
+
+			static void* clone(const vtable_entry* vt, const void* v) {
+				auto alignment = vt[alignment_entry].value;
+				void* p = allocate_node(vt[size_entry].value, alignment);
+				try {
+					copy_value(vt, p, v);
+				}
+				catch (...) {
+					deallocate_node(p, alignment);
+					throw;
+				}
+				return p;
+			}
+
+			void unshare(const vtable_entry* vt) {
+				if (is_shared()) {
+					void* p = clone(vt, ptr_);
+					release(vt);
+					ptr_ = p;
+				}
+			}
+
+		public:
+			static constexpr bool owns_value = true;
+
+			template<typename T>
+			cow_holder(T t, value_tag) {
+				static_assert(std::is_copy_constructible_v<T>, "object requires a copyable value");
+				void* p = allocate_node(sizeof(T), alignof(T));
+				try {
+					ptr_ = ::new (p) T(std::move(t));
+				}
+				catch (...) {
+					deallocate_node(p, alignof(T));
+					throw;
+				}
+			}
+
+			cow_holder(const cow_holder& other, const vtable_entry* vt) :ptr_(other.ptr_) {
+				if (!vt) return;
+				if (count().load(std::memory_order_relaxed) == unshareable) {
+					ptr_ = clone(vt, other.ptr_);
+				}
+				else {
+					count().fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			cow_holder(cow_holder&& other, const vtable_entry*)noexcept :ptr_(other.ptr_) {}
+
+			void destroy(const vtable_entry* vt) noexcept { release(vt); }
+
+			bool is_shared()const {
+				auto n = count().load(std::memory_order_acquire);
+				return n != 1 && n != unshareable;
+			}
+			void* get_ptr(const vtable_entry* vt) {
+				unshare(vt);
+				return ptr_;
 			}
+
+			// For refs, which can outlive the sharing of the value or change it
+			// while copies are made.
+			void* get_unshareable_ptr(const vtable_entry* vt) {
+				unshare(vt);
+				count().store(unshareable, std::memory_order_relaxed);
+				return ptr_;
+			}
+			const void* get_ptr(const vtable_entry*)const { return ptr_; }
+		};
+
+		struct shared_ptr_holder {
+			std::shared_ptr<const void> impl_;
+
+			struct deleter {
+				const vtable_entry* vt;
+				void operator()(const void* p) const { delete_value(vt, const_cast<void*>(p)); }
+			};
+
+			static constexpr bool owns_value = true;
+
 			template<typename T>
-			shared_ptr_holder(T t, value_tag) :impl_(std::make_shared<const holder_impl<T>>(std::move(t))), ptr_(get_ptr_impl()) {}
-			shared_ptr_holder(const value_holder& v) :impl_(v.clone_ptr()), ptr_(get_ptr_impl()) {}
-			auto clone_ptr()const { return impl_ ? impl_->clone() : nullptr; }
+			shared_ptr_holder(T t, value_tag) :impl_(std::make_shared<const T>(std::move(t))) {}
+			shared_ptr_holder(const shared_ptr_holder& other, const vtable_entry*) :impl_(other.impl_) {}
+			shared_ptr_holder(shared_ptr_holder&& other, const vtable_entry*)noexcept
+				:impl_(std::move(other.impl_)) {}
+
+			// Copies the value out of a holder that does not share it.
+			template <typename OtherHolder>
+			shared_ptr_holder(const OtherHolder& other, const vtable_entry* vt)
+				:impl_(clone_value(vt, other.get_ptr(vt)), deleter{ vt }) {}
+
+			void destroy(const vtable_entry*) noexcept { impl_.reset(); }
+
+			const void* get_ptr(const vtable_entry*)const { return impl_.get(); }
 		};
 
 		template<typename T>
 		struct ptr_holder {
 			T* ptr_;
 			T* get_ptr()const { return ptr_; }
+			T* get_ptr(const vtable_entry*)const { return ptr_; }
+
+			static constexpr bool owns_value = false;
+
 			template<typename V>
 			ptr_holder(V& v, value_tag) :ptr_(&v) {}
 
@@ -224,15 +907,523 @@ namespace polymorphic {
 				return (*this) = ptr_holder(other);
 			}
 
-			ptr_holder(value_holder& v) :ptr_(v.get_ptr()) {}
-			ptr_holder(const value_holder& v) :ptr_(v.get_ptr()) {}
-			ptr_holder(const shared_ptr_holder& v) :ptr_(v.get_ptr()) {}
-	
+			// From the holder of another ref or object. A ref to a non-const
+			// cow_object unshares the value and keeps later copies of the
+			// object from sharing it.
+			template <typename Holder>
+			ptr_holder(Holder&& h, const vtable_entry* vt) :ptr_(get_holder_ptr(h, vt)) {}
+
+			template <typename Holder>
+			static T* get_holder_ptr(Holder& h, const vtable_entry* vt) {
+				if constexpr (requires { h.get_unshareable_ptr(vt); }) {
+					return h.get_unshareable_ptr(vt);
+				}
+				else if constexpr (std::is_const_v<T>) {
+					return std::as_const(h).get_ptr(vt);
+				}
+				else {
+					return h.get_ptr(vt);
+				}
+			}
+		};
+
+
+		// Calls Method on every element of a std::vector<T>. Because T is known,
+		// poly_extend is called directly and can be inlined into the loop.
+		template <typename T, typename Signature> struct loop_trampoline;
+
+		template <typename T, typename Return, typename Method, typename... Parameters>
+		struct loop_trampoline<T, Return(Method, Parameters...)> {
+			static void jump(void* v, Parameters&... parameters) {
+				for (auto& t : *static_cast<std::vector<T>*>(v)) {
+					poly_extend(Method{}, t, parameters...);
+				}
+			}
+		};
+
+		template <typename T, typename Return, typename Method, typename... Parameters>
+		struct loop_trampoline<T, Return(Method, Parameters...) const> {
+			static void jump(const void* v, Parameters&... parameters) {
+				for (const auto& t : *static_cast<const std::vector<T>*>(v)) {
+					poly_extend(Method{}, t, parameters...);
+				}
+			}
 		};
 
+		template <typename T, typename... Signatures>
+		inline const vtable_fun loop_vtable[] = {
+			reinterpret_cast<vtable_fun>(loop_trampoline<T, Signatures>::jump)... };
+
+		template <size_t I, typename Signature> struct loop_caller;
+
+		template <size_t I, typename Method, typename Return, typename... Parameters>
+		struct loop_caller<I, Return(Method, Parameters...)> {
+			void operator()(const vtable_fun* vt, Method, void* v,
+				Parameters... parameters) const {
+				reinterpret_cast<ptr<void(void*, Parameters&...)>>(vt[I])(v, parameters...);
+			}
+		};
+
+		template <size_t I, typename Method, typename Return, typename... Parameters>
+		struct loop_caller<I, Return(Method, Parameters...) const> {
+			void operator()(const vtable_fun* vt, Method, const void* v,
+				Parameters... parameters) const {
+				reinterpret_cast<ptr<void(const void*, Parameters&...)>>(vt[I])(v, parameters...);
+			}
+		};
+
+		template <typename Sequence, typename... Signatures> struct loop_dispatcher;
+
+		template <size_t... I, typename... Signatures>
+		struct loop_dispatcher<std::index_sequence<I...>, Signatures...>
+			: overload<loop_caller<I, Signatures>...> {};
+
+		// Calls the batch overload
+		// poly_extend(Method{}, std::span<T>, std::span<Return>, parameters...)
+		// if there is one, and poly_extend on each value otherwise. Results are
+		// written to out. The batch overload has no out span if Return is void.
+		template <typename Return, typename Method, typename T, typename... Parameters>
+		void batch_call(std::span<T> values, void* out, Parameters&... parameters) {
+			if constexpr (std::is_void_v<Return>) {
+				if constexpr (requires { poly_extend(Method{}, values, parameters...); }) {
+					poly_extend(Method{}, values, parameters...);
+				}
+				else {
+					for (auto& t : values) {
+						poly_extend(Method{}, t, parameters...);
+					}
+				}
+			}
+			else {
+				std::span<Return> results(static_cast<Return*>(out), values.size());
+				if constexpr (requires { poly_extend(Method{}, values, results, parameters...); }) {
+					poly_extend(Method{}, values, results, parameters...);
+				}
+				else {
+					for (std::size_t i = 0; i < values.size(); ++i) {
+						results[i] = poly_extend(Method{}, values[i], parameters...);
+					}
+				}
+			}
+		}
+
+		template <typename T, typename Signature> struct batch_trampoline;
+
+		template <typename T, typename Return, typename Method, typename... Parameters>
+		struct batch_trampoline<T, Return(Method, Parameters...)> {
+			static void jump(void* v, void* out, Parameters&... parameters) {
+				batch_call<Return, Method>(std::span<T>(*static_cast<std::vector<T>*>(v)),
+					out, parameters...);
+			}
+		};
+
+		template <typename T, typename Return, typename Method, typename... Parameters>
+		struct batch_trampoline<T, Return(Method, Parameters...) const> {
+			static void jump(const void* v, void* out, Parameters&... parameters) {
+				batch_call<Return, Method>(std::span<const T>(*static_cast<const std::vector<T>*>(v)),
+					out, parameters...);
+			}
+		};
+
+		template <typename T, typename... Signatures>
+		inline const vtable_fun batch_vtable[] = {
+			reinterpret_cast<vtable_fun>(batch_trampoline<T, Signatures>::jump)... };
+
+		// The count results of a segment are written starting at out[offset].
+		template <size_t I, typename Signature> struct batch_caller;
+
+		template <size_t I, typename Method, typename Return, typename... Parameters>
+		struct batch_caller<I, Return(Method, Parameters...)> {
+			void operator()(const vtable_fun* vt, Method, void* v, std::size_t offset,
+				std::size_t count, std::span<Return> out, Parameters... parameters) const {
+				assert(out.size() >= offset + count && "out needs room for size() results");
+				reinterpret_cast<ptr<void(void*, void*, Parameters&...)>>(vt[I])(
+					v, out.data() + offset, parameters...);
+			}
+		};
+
+		template <size_t I, typename Method, typename... Parameters>
+		struct batch_caller<I, void(Method, Parameters...)> {
+			void operator()(const vtable_fun* vt, Method, void* v, std::size_t,
+				std::size_t, Parameters... parameters) const {
+				reinterpret_cast<ptr<void(void*, void*, Parameters&...)>>(vt[I])(
+					v, nullptr, parameters...);
+			}
+		};
+
+		template <size_t I, typename Method, typename Return, typename... Parameters>
+		struct batch_caller<I, Return(Method, Parameters...) const> {
+			void operator()(const vtable_fun* vt, Method, const void* v, std::size_t offset,
+				std::size_t count, std::span<Return> out, Parameters... parameters) const {
+				assert(out.size() >= offset + count && "out needs room for size() results");
+				reinterpret_cast<ptr<void(const void*, void*, Parameters&...)>>(vt[I])(
+					v, out.data() + offset, parameters...);
+			}
+		};
+
+		template <size_t I, typename Method, typename... Parameters>
+		struct batch_caller<I, void(Method, Parameters...) const> {
+			void operator()(const vtable_fun* vt, Method, const void* v, std::size_t,
+				std::size_t, Parameters... parameters) const {
+				reinterpret_cast<ptr<void(const void*, void*, Parameters&...)>>(vt[I])(
+					v, nullptr, parameters...);
+			}
+		};
+
+		template <typename Sequence, typename... Signatures> struct batch_dispatcher;
+
+		template <size_t... I, typename... Signatures>
+		struct batch_dispatcher<std::index_sequence<I...>, Signatures...>
+			: overload<batch_caller<I, Signatures>...> {};
+
+		struct segment_interface {
+			virtual void* get_ptr() = 0;
+			virtual std::size_t size() const = 0;
+			virtual ~segment_interface() {}
+		};
+
+		template <typename T>
+		struct segment_impl :segment_interface {
+			void* get_ptr() override { return &elements_; }
+			std::size_t size() const override { return elements_.size(); }
+			std::vector<T> elements_;
+		};
+
+		struct segment {
+			const vtable_entry* vptr_;
+			const vtable_fun* loop_vptr_;
+			const vtable_fun* batch_vptr_;
+			std::unique_ptr<segment_interface> impl_;
+		};
 
 	} // namespace detail
 
+	// Stores values in one contiguous segment per concrete type. Calls through
+	// for_each_call go through one indirect call per segment, and then call
+	// poly_extend directly on each element of the segment.
+	template <typename... Signatures>
+	class poly_collection {
+		std::vector<detail::segment> segments_;
+
+		static constexpr detail::loop_dispatcher<
+			std::make_index_sequence<sizeof...(Signatures)>, Signatures...> call_loop{};
+		static constexpr detail::batch_dispatcher<
+			std::make_index_sequence<sizeof...(Signatures)>, Signatures...> call_batch_loop{};
+
+		template <typename T>
+		std::vector<T>& get_segment() {
+			const detail::vtable_entry* vptr = &detail::vtable<T, Signatures...>[0];
+			for (auto& s : segments_) {
+				if (s.vptr_ == vptr) {
+					return *static_cast<std::vector<T>*>(s.impl_->get_ptr());
+				}
+			}
+			segments_.push_back({ vptr, &detail::loop_vtable<T, Signatures...>[0],
+				&detail::batch_vtable<T, Signatures...>[0],
+				std::make_unique<detail::segment_impl<T>>() });
+			return *static_cast<std::vector<T>*>(segments_.back().impl_->get_ptr());
+		}
+
+	public:
+		template <typename T>
+		void insert(T t) {
+			get_segment<T>().push_back(std::move(t));
+		}
+
+		template <typename T, typename... Args>
+		T& emplace(Args&&... args) {
+			return get_segment<T>().emplace_back(std::forward<Args>(args)...);
+		}
+
+		template <typename T>
+		void reserve(std::size_t n) {
+			get_segment<T>().reserve(n);
+		}
+
+		// Parameters are passed to each element as lvalues, so that an rvalue
+		// argument is not moved from before the last segment.
+		template <typename Method, typename... Parameters>
+		void for_each_call(Parameters&&... parameters) {
+			for (auto& s : segments_) {
+				call_loop(s.loop_vptr_, Method{}, s.impl_->get_ptr(), parameters...);
+			}
+		}
+
+		template <typename Method, typename... Parameters>
+		void for_each_call(Parameters&&... parameters) const {
+			for (auto& s : segments_) {
+				call_loop(s.loop_vptr_, Method{},
+					static_cast<const void*>(s.impl_->get_ptr()), parameters...);
+			}
+		}
+
+		// Like for_each_call, but calls Method on a std::span of each segment.
+		// Types can provide a batch overload
+		// poly_extend(Method{}, std::span<T>, std::span<Return>, parameters...),
+		// otherwise poly_extend is called on each value. For methods that do not
+		// return void, the first parameter is a std::span<Return> with room for
+		// size() results, which are written in segment order. A smaller span
+		// fails an assertion.
+		template <typename Method, typename... Parameters>
+		void call_batch(Parameters&&... parameters) {
+			std::size_t offset = 0;
+			for (auto& s : segments_) {
+				auto count = s.impl_->size();
+				call_batch_loop(s.batch_vptr_, Method{}, s.impl_->get_ptr(), offset, count,
+					parameters...);
+				offset += count;
+			}
+		}
+
+		template <typename Method, typename... Parameters>
+		void call_batch(Parameters&&... parameters) const {
+			std::size_t offset = 0;
+			for (auto& s : segments_) {
+				auto count = s.impl_->size();
+				call_batch_loop(s.batch_vptr_, Method{}, static_cast<const void*>(s.impl_->get_ptr()),
+					offset, count, parameters...);
+				offset += count;
+			}
+		}
+
+		std::size_t size() const {
+			std::size_t n = 0;
+			for (auto& s : segments_) n += s.impl_->size();
+			return n;
+		}
+
+		std::size_t segment_count() const { return segments_.size(); }
+
+		void clear() { segments_.clear(); }
+	};
+
+	namespace detail {
+		template <std::size_t I, typename... Types>
+		using type_at = std::tuple_element_t<I, std::tuple<Types...>>;
+
+		template <typename... Signatures> struct find_type_list {};
+
+		template <typename First, typename... Rest>
+		struct find_type_list<First, Rest...> :find_type_list<Rest...> {};
+
+		template <typename TypeList, typename... Rest>
+		struct find_type_list<std::size_t(type_index<TypeList>) const, Rest...> {
+			using type = TypeList;
+		};
+
+		template <typename Ref> struct ref_type_list;
+
+		template <typename Holder, typename Sequence, typename... Signatures>
+		struct ref_type_list<ref_impl<Holder, Sequence, Signatures...>>
+			:find_type_list<Signatures...> {};
+
+		template <typename Holder, typename Sequence, typename... Signatures>
+		struct ref_type_list<inline_ref_impl<Holder, Sequence, Signatures...>>
+			:find_type_list<Signatures...> {};
+
+		template <typename Ref>
+		using ref_type_list_t = typename ref_type_list<std::decay_t<Ref>>::type;
+
+		template <typename Ptr, typename T>
+		using same_const_as = std::conditional_t<
+			std::is_const_v<std::remove_pointer_t<Ptr>>, const T, T>;
+
+		template <typename Method, typename A, typename B, typename Return,
+			typename PtrA, typename PtrB, typename... Parameters>
+		Return dispatch2_jump(PtrA a, PtrB b, Parameters&&... parameters) {
+			return poly_extend(Method{}, *static_cast<A*>(a), *static_cast<B*>(b),
+				std::forward<Parameters>(parameters)...);
+		}
+
+		template <typename Method, typename TypeListA, typename TypeListB,
+			typename PtrA, typename PtrB, typename... Parameters>
+		struct dispatch2_table;
+
+		// Table of function pointers for all pairs of types, indexed by
+		// i * sizeof...(TypesB) + j.
+		template <typename Method, typename... TypesA, typename... TypesB,
+			typename PtrA, typename PtrB, typename... Parameters>
+		struct dispatch2_table<Method, type_list<TypesA...>, type_list<TypesB...>,
+			PtrA, PtrB, Parameters...> {
+			static constexpr std::size_t columns = sizeof...(TypesB);
+
+			template <std::size_t K>
+			using a_type = same_const_as<PtrA, type_at<K / columns, TypesA...>>;
+			template <std::size_t K>
+			using b_type = same_const_as<PtrB, type_at<K % columns, TypesB...>>;
+
+			using return_type = decltype(poly_extend(Method{}, std::declval<a_type<0>&>(),
+				std::declval<b_type<0>&>(), std::declval<Parameters>()...));
+			using fun = ptr<return_type(PtrA, PtrB, Parameters&&...)>;
+
+			template <std::size_t... K>
+			static constexpr std::array<fun, sizeof...(K)> make(std::index_sequence<K...>) {
+				return { &dispatch2_jump<Method, a_type<K>, b_type<K>, return_type,
+					PtrA, PtrB, Parameters...>... };
+			}
+
+			static constexpr auto table =
+				make(std::make_index_sequence<sizeof...(TypesA) * sizeof...(TypesB)>());
+		};
+
+	} // namespace detail
+
+	// Lets poly_collection call type_index like any other method.
+	template <typename T, typename... Types>
+	std::size_t poly_extend(type_index<type_list<Types...>>, const T&) {
+		constexpr auto index = detail::index_of<T, Types...>();
+		static_assert(index < sizeof...(Types), "type is not in the type_list");
+		return index;
+	}
+
+	// Calls poly_extend(Method{}, a_value, b_value, parameters...) selected on
+	// the types of the values of both a and b. The type_list of each ref comes
+	// from its type_index signature, and the call goes through a table of
+	// function pointers for all the pairs of types. The values are const if a
+	// or b only give const access.
+	template <typename Method, typename RefA, typename RefB, typename... Parameters>
+	decltype(auto) dispatch2(RefA&& a, RefB&& b, Parameters&&... parameters) {
+		using TypeListA = detail::ref_type_list_t<RefA>;
+		using TypeListB = detail::ref_type_list_t<RefB>;
+		auto pa = a.get_ptr();
+		auto pb = b.get_ptr();
+		using table = detail::dispatch2_table<Method, TypeListA, TypeListB,
+			decltype(pa), decltype(pb), Parameters...>;
+		auto i = std::as_const(a).template call<type_index<TypeListA>>();
+		auto j = std::as_const(b).template call<type_index<TypeListB>>();
+		return table::table[i * table::columns + j](pa, pb,
+			std::forward<Parameters>(parameters)...);
+	}
+
+	namespace detail {
+		// Overload resolution on operator() picks the signature the same way
+		// as vtable_caller, and call then calls poly_extend directly.
+		template <typename Signature> struct sealed_caller;
+
+		template <typename Method, typename Return, typename... Parameters>
+		struct sealed_caller<Return(Method, Parameters...)> {
+			sealed_caller operator()(Method, void*, Parameters...) const;
+
+			template <typename T>
+			static Return call(T& t, Parameters... parameters) {
+				return poly_extend(Method{}, t, fwd<Parameters>(parameters)...);
+			}
+		};
+
+		template <typename Method, typename Return, typename... Parameters>
+		struct sealed_caller<Return(Method, Parameters...) const> {
+			sealed_caller operator()(Method, const void*, Parameters...) const;
+
+			template <typename T>
+			static Return call(const T& t, Parameters... parameters) {
+				return poly_extend(Method{}, t, fwd<Parameters>(parameters)...);
+			}
+		};
+
+		template <std::size_t I, std::size_t N>
+		using clamped_index = std::integral_constant<std::size_t, (I < N ? I : N - 1)>;
+
+		// Calls f with std::integral_constant<std::size_t, i>, through a switch
+		// so that f can be inlined for each case. Covers 16 indexes per switch.
+		template <std::size_t I, std::size_t N, typename F>
+		decltype(auto) with_index(std::size_t i, F&& f) {
+			switch (i - I) {
+				case 0: return f(clamped_index<I + 0, N>{});
+				case 1: return f(clamped_index<I + 1, N>{});
+				case 2: return f(clamped_index<I + 2, N>{});
+				case 3: return f(clamped_index<I + 3, N>{});
+				case 4: return f(clamped_index<I + 4, N>{});
+				case 5: return f(clamped_index<I + 5, N>{});
+				case 6: return f(clamped_index<I + 6, N>{});
+				case 7: return f(clamped_index<I + 7, N>{});
+				case 8: return f(clamped_index<I + 8, N>{});
+				case 9: return f(clamped_index<I + 9, N>{});
+				case 10: return f(clamped_index<I + 10, N>{});
+				case 11: return f(clamped_index<I + 11, N>{});
+				case 12: return f(clamped_index<I + 12, N>{});
+				case 13: return f(clamped_index<I + 13, N>{});
+				case 14: return f(clamped_index<I + 14, N>{});
+				case 15: return f(clamped_index<I + 15, N>{});
+			default:
+				if constexpr (I + 16 < N) {
+					return with_index<I + 16, N>(i, std::forward<F>(f));
+				}
+				else {
+					return f(clamped_index<N - 1, N>{});
+				}
+			}
+		}
+	} // namespace detail
+
+	template <typename TypeList, typename... Signatures>
+	class sealed_object;
+
+	// Like object, but for a closed set of types. Stores the value in a
+	// std::variant, and dispatches on its index instead of through a vtable,
+	// so poly_extend can be inlined at the call site.
+	template <typename... Types, typename... Signatures>
+	class sealed_object<type_list<Types...>, Signatures...> {
+		std::variant<Types...> value_;
+
+		static constexpr detail::overload<detail::sealed_caller<Signatures>...> select{};
+
+		// with_index clamps out of range indexes, so a variant that is valueless
+		// by exception has to be caught before dispatching on its index.
+		std::size_t checked_index() const {
+			if (value_.valueless_by_exception()) throw std::bad_variant_access();
+			return value_.index();
+		}
+
+		template <typename Self, typename Method, typename Ptr, typename... Parameters>
+		static decltype(auto) call_impl(Self& self, Ptr, Parameters&&... parameters) {
+			using caller = decltype(select(Method{}, std::declval<Ptr>(),
+				std::declval<Parameters>()...));
+			return detail::with_index<0, sizeof...(Types)>(self.checked_index(), [&](auto i)->decltype(auto) {
+				return caller::call(*std::get_if<decltype(i)::value>(&self.value_),
+					std::forward<Parameters>(parameters)...);
+				});
+		}
+
+	public:
+		template <typename T, typename = std::enable_if_t<
+			(detail::index_of<std::decay_t<T>, Types...>() < sizeof...(Types))>>
+		sealed_object(T&& t) :value_(std::in_place_type<std::decay_t<T>>, std::forward<T>(t)) {}
+
+		// Index of the type of the value in Types, or std::variant_npos if an
+		// exception left the object without a value.
+		std::size_t index() const { return value_.index(); }
+
+		// Null if an exception left the object without a value.
+		const void* get_ptr() const {
+			if (value_.valueless_by_exception()) return nullptr;
+			return detail::with_index<0, sizeof...(Types)>(value_.index(), [&](auto i) {
+				return static_cast<const void*>(std::get_if<decltype(i)::value>(&value_));
+				});
+		}
+		void* get_ptr() { return const_cast<void*>(std::as_const(*this).get_ptr()); }
+
+#ifdef POLYMORPHIC_PROFILE
+		const std::type_info& value_type_info() const {
+			return detail::with_index<0, sizeof...(Types)>(checked_index(),
+				[](auto i) -> const std::type_info& { return typeid(detail::type_at<decltype(i)::value, Types...>); });
+		}
+#endif
+
+		template <typename Method, typename... Parameters>
+		POLYMORPHIC_PROFILE_NOINLINE decltype(auto) call(Parameters&&... parameters) const {
+			POLYMORPHIC_PROFILE_CALL(Method, value_type_info());
+			return call_impl<const sealed_object, Method>(*this, static_cast<const void*>(nullptr),
+				std::forward<Parameters>(parameters)...);
+		}
+
+		template <typename Method, typename... Parameters>
+		POLYMORPHIC_PROFILE_NOINLINE decltype(auto) call(Parameters&&... parameters) {
+			POLYMORPHIC_PROFILE_CALL(Method, value_type_info());
+			return call_impl<sealed_object, Method>(*this, static_cast<void*>(nullptr),
+				std::forward<Parameters>(parameters)...);
+		}
+	};
+
 	template <typename... Signatures>
 	using ref = detail::ref_impl<
 		detail::ptr_holder<std::conditional_t<
@@ -240,11 +1431,275 @@ namespace polymorphic {
 		const void, void>>,
 		std::make_index_sequence<sizeof...(Signatures)>, Signatures...>;
 
+	// Like object, but copies share the value until it is accessed through a
+	// non-const signature.
+	template <typename... Signatures>
+	using cow_object = detail::ref_impl<detail::cow_holder,
+		std::make_index_sequence<sizeof...(Signatures)>, Signatures...>;
+
+	using detail::arena_destroy;
+
+	// Use with arena_object to allocate t from r.
+	template <typename T>
+	detail::arena_value<std::decay_t<T>> in_arena(std::pmr::memory_resource& r, T&& t) {
+		return { &r, std::forward<T>(t) };
+	}
+
+	// Like object, but allocates the value from the memory resource passed with
+	// in_arena, or from the default resource otherwise. With
+	// arena_destroy::non_trivial_only, values have to be passed with in_arena.
+	template <arena_destroy Destroy, typename... Signatures>
+	using basic_arena_object = detail::ref_impl<detail::arena_holder<Destroy>,
+		std::make_index_sequence<sizeof...(Signatures)>, Signatures...>;
+
 	template <typename... Signatures>
-	using object = detail::ref_impl<
+	using arena_object = basic_arena_object<arena_destroy::always, Signatures...>;
+
+	// inline_ref stores the function pointers in the ref itself when there are
+	// at most this many signatures, and is a regular ref otherwise.
+	inline constexpr std::size_t max_inline_ref_signatures = 2;
+
+	template <typename... Signatures>
+	using inline_ref = std::conditional_t<
+		(sizeof...(Signatures) <= max_inline_ref_signatures),
+		detail::inline_ref_impl<
+		detail::ptr_holder<std::conditional_t<
+		std::conjunction_v<detail::is_const_signature<Signatures>...>,
+		const void, void>>,
+		std::make_index_sequence<sizeof...(Signatures)>, Signatures...>,
+		ref<Signatures...>>;
+
+	// Values up to this size and alignment are stored inline by object.
+	inline constexpr std::size_t default_inline_size = sizeof(void*);
+	inline constexpr std::size_t default_inline_alignment = alignof(void*);
+
+	// Like object, but with configurable inline storage for the value. Objects
+	// with only const signatures share the value and do not use inline storage.
+	template <std::size_t Size, std::size_t Alignment, typename... Signatures>
+	using basic_object = detail::ref_impl<
 		std::conditional_t<
 		std::conjunction_v<detail::is_const_signature<Signatures>...>,
-		detail::shared_ptr_holder, detail::value_holder >,
+		detail::shared_ptr_holder, detail::value_holder<Size, Alignment> >,
 		std::make_index_sequence<sizeof...(Signatures)>, Signatures...>;
 
+	template <typename... Signatures>
+	using object = basic_object<default_inline_size, default_inline_alignment,
+		Signatures...>;
+
+
+	namespace detail {
+		// Read-side state of one thread. seq is odd while the thread is inside a
+		// read section, and is only written by the owning thread, so readers do
+		// not share any cache lines.
+		struct alignas(64) rcu_record {
+			std::atomic<std::uint64_t> seq{ 0 };
+			std::atomic<bool> in_use{ true };
+			rcu_record* next = nullptr;
+			unsigned nesting = 0;
+		};
+
+		// Records are never freed. Records of threads that have exited are
+		// reused by new threads.
+		class rcu_domain {
+			std::atomic<rcu_record*> head_{ nullptr };
+
+		public:
+			rcu_record* acquire_record() {
+				for (auto r = head_.load(std::memory_order_acquire); r; r = r->next) {
+					bool in_use = false;
+					if (!r->in_use.load(std::memory_order_relaxed) &&
+						r->in_use.compare_exchange_strong(in_use, true, std::memory_order_acquire)) {
+						return r;
+					}
+				}
+				auto r = new rcu_record;
+				r->next = head_.load(std::memory_order_relaxed);
+				while (!head_.compare_exchange_weak(r->next, r, std::memory_order_release,
+					std::memory_order_relaxed)) {
+				}
+				return r;
+			}
+
+			// Waits until every thread that was inside a read section when this
+			// was called has left it.
+			void synchronize() {
+				for (auto r = head_.load(std::memory_order_acquire); r; r = r->next) {
+					auto seq = r->seq.load(std::memory_order_seq_cst);
+					if (seq % 2 == 0) continue;
+					while (r->seq.load(std::memory_order_acquire) == seq) {
+						std::this_thread::yield();
+					}
+				}
+			}
+		};
+
+		inline rcu_domain& get_rcu_domain() {
+			static rcu_domain domain;
+			return domain;
+		}
+
+		struct rcu_thread {
+			rcu_record* record = get_rcu_domain().acquire_record();
+			~rcu_thread() { record->in_use.store(false, std::memory_order_release); }
+		};
+
+		inline rcu_record& this_thread_rcu_record() {
+			thread_local rcu_thread thread;
+			return *thread.record;
+		}
+
+		// The seq_cst store pairs with the seq_cst exchange and load in
+		// atomic_shared::store and rcu_domain::synchronize, so either the writer
+		// sees the reader in its section, or the reader sees the new value.
+		inline rcu_record& rcu_read_lock() {
+			auto& r = this_thread_rcu_record();
+			if (r.nesting++ == 0) {
+				r.seq.store(r.seq.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+			}
+			return r;
+		}
+
+		inline void rcu_read_unlock(rcu_record& r) {
+			if (--r.nesting == 0) {
+				r.seq.store(r.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			}
+		}
+	} // namespace detail
+
+	// Holds a value with only const signatures that many threads read, and
+	// that is rarely replaced. Reads are wait-free and only write to memory
+	// owned by the reading thread, so unlike copies of an object they do not
+	// contend on a reference count. store replaces the value, and waits for
+	// the readers of the old value before destroying it. Do not call store
+	// from inside a read.
+	template <typename... Signatures>
+	class atomic_shared {
+		static_assert(std::conjunction_v<detail::is_const_signature<Signatures>...>,
+			"atomic_shared requires const signatures");
+
+		using value_type = detail::ref_impl<
+			detail::value_holder<default_inline_size, default_inline_alignment>,
+			std::make_index_sequence<sizeof...(Signatures)>, Signatures...>;
+
+		std::atomic<const value_type*> value_;
+
+	public:
+		// Keeps the value read from an atomic_shared alive. Must be destroyed
+		// on the thread that created it.
+		class read_guard {
+			detail::rcu_record& record_;
+			const value_type* value_;
+
+		public:
+			explicit read_guard(const std::atomic<const value_type*>& value)
+				:record_(detail::rcu_read_lock()), value_(value.load(std::memory_order_seq_cst)) {}
+			read_guard(const read_guard&) = delete;
+			read_guard& operator=(const read_guard&) = delete;
+			~read_guard() { detail::rcu_read_unlock(record_); }
+
+			ref<Signatures...> get() const { return *value_; }
+
+			template <typename Method, typename... Parameters>
+			decltype(auto) call(Parameters&&... parameters) const {
+				return value_->template call<Method>(std::forward<Parameters>(parameters)...);
+			}
+		};
+
+		template <typename T>
+		explicit atomic_shared(T t) :value_(new value_type(std::move(t))) {}
+		atomic_shared(const atomic_shared&) = delete;
+		atomic_shared& operator=(const atomic_shared&) = delete;
+		~atomic_shared() { delete value_.load(std::memory_order_relaxed); }
+
+		template <typename T>
+		void store(T t) {
+			auto old = value_.exchange(new value_type(std::move(t)), std::memory_order_seq_cst);
+			detail::get_rcu_domain().synchronize();
+			delete old;
+		}
+
+		read_guard read() const { return read_guard(value_); }
+
+		template <typename Method, typename... Parameters>
+		decltype(auto) call(Parameters&&... parameters) const {
+			return read().template call<Method>(std::forward<Parameters>(parameters)...);
+		}
+	};
+
+#ifdef POLYMORPHIC_PROFILE
+	namespace profile {
+		// Number of calls of method on a value of type from the call site with
+		// the given return address.
+		struct call_count {
+			std::string method;
+			std::string type;
+			const void* site;
+			std::uint64_t count;
+		};
+
+		inline std::string type_name(const std::type_info& t) {
+#if __has_include(<cxxabi.h>)
+			int status = 0;
+			std::unique_ptr<char, void(*)(void*)> name(
+				abi::__cxa_demangle(t.name(), nullptr, nullptr, &status), std::free);
+			if (status == 0) return name.get();
+#endif
+			return t.name();
+		}
+
+		inline std::vector<call_count> call_counts() {
+			auto& data = detail::get_profile_data();
+			std::vector<call_count> counts;
+			std::lock_guard<std::mutex> lock(data.mutex);
+			for (auto& [key, count] : data.counts) {
+				counts.push_back({ type_name(*key.method), type_name(*key.type), key.site, count });
+			}
+			return counts;
+		}
+
+		inline void reset() {
+			auto& data = detail::get_profile_data();
+			std::lock_guard<std::mutex> lock(data.mutex);
+			data.counts.clear();
+		}
+
+		// Writes the calls per method and type, followed by the types seen at
+		// each call site, most frequent first. Call sites are return addresses,
+		// which addr2line or a debugger can map to source lines.
+		inline void report(std::ostream& os) {
+			auto counts = call_counts();
+			auto by_count = [](const auto& a, const auto& b) { return a.second > b.second; };
+
+			std::unordered_map<std::string, std::uint64_t> per_type;
+			std::unordered_map<const void*, std::vector<call_count>> per_site;
+			for (auto& c : counts) {
+				per_type[c.method + " " + c.type] += c.count;
+				per_site[c.site].push_back(c);
+			}
+
+			os << "calls by method and type:\n";
+			std::vector<std::pair<std::string, std::uint64_t>> types(per_type.begin(), per_type.end());
+			std::sort(types.begin(), types.end(), by_count);
+			for (auto& [name, count] : types) {
+				os << "  " << name << ": " << count << "\n";
+			}
+
+			os << "call sites:\n";
+			for (auto& [site, site_counts] : per_site) {
+				std::uint64_t total = 0;
+				for (auto& c : site_counts) total += c.count;
+				std::sort(site_counts.begin(), site_counts.end(),
+					[](const auto& a, const auto& b) { return a.count > b.count; });
+				os << "  " << site << " " << site_counts.front().method << ": "
+					<< site_counts.size() << " types, " << total << " calls\n";
+				for (auto& c : site_counts) {
+					os << "    " << c.type << ": " << c.count << " ("
+						<< 100 * c.count / total << "%)\n";
+				}
+			}
+		}
+	} // namespace profile
+	} // namespace profile_build
+#endif
+
 } // namespace polymorphic
@@ -0,0 +1,103 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// limitations under the License.
+
+#define POLYMORPHIC_PROFILE
+#include <gmock/gmock.h>
+#include <set>
+#include <sstream>
+#include <string>
+#include "polymorphic.hpp"
+
+struct x2 {};
+struct stupid_hash {};
+
+void poly_extend(x2, int& i) { i *= 2; }
+void poly_extend(x2, std::string& s) { s = s + s; }
+
+int poly_extend(stupid_hash, const int& i) { return i; }
+int poly_extend(stupid_hash, const std::string& s) { return static_cast<int>(s.size()); }
+
+std::uint64_t count_calls(const std::string& method, const std::string& type) {
+	std::uint64_t n = 0;
+	for (auto& c : polymorphic::profile::call_counts()) {
+		if (c.method == method && c.type == type) n += c.count;
+	}
+	return n;
+}
+
+TEST(PolymorphicProfile, CountsPerMethodAndType) {
+	polymorphic::profile::reset();
+	polymorphic::object<void(x2), int(stupid_hash)const> objects[] = { 1, std::string("a"), 2 };
+	for (auto& o : objects) {
+		o.call<x2>();
+	}
+	for (auto& o : objects) {
+		o.call<stupid_hash>();
+	}
+	EXPECT_THAT(count_calls("x2", "int"), 2);
+	EXPECT_THAT(count_calls("x2", polymorphic::profile::type_name(typeid(std::string))), 1);
+	EXPECT_THAT(count_calls("stupid_hash", "int"), 2);
+
+	polymorphic::sealed_object<polymorphic::type_list<int, std::string>, int(stupid_hash)const> s{ 3 };
+	s.call<stupid_hash>();
+	EXPECT_THAT(count_calls("stupid_hash", "int"), 3);
+
+	polymorphic::inline_ref<int(stupid_hash)const> r = objects[1];
+	r.call<stupid_hash>();
+	polymorphic::inline_ref<int(stupid_hash)const> r2 = std::as_const(objects[0]);
+	r2.call<stupid_hash>();
+	EXPECT_THAT(count_calls("stupid_hash", polymorphic::profile::type_name(typeid(std::string))), 2);
+	EXPECT_THAT(count_calls("stupid_hash", "int"), 4);
+}
+
+using hash_object = polymorphic::object<int(stupid_hash)const>;
+
+// Unrolled loops have one call site per copy of the body, and tail calls
+// are attributed to the caller's caller, so each site is in its own function
+// and uses the result.
+POLYMORPHIC_PROFILE_NOINLINE void megamorphic_site(const hash_object& o, int& total) {
+	total += o.call<stupid_hash>();
+}
+POLYMORPHIC_PROFILE_NOINLINE void monomorphic_site(const hash_object& o, int& total) {
+	total += o.call<stupid_hash>();
+}
+
+TEST(PolymorphicProfile, CallSites) {
+	polymorphic::profile::reset();
+	hash_object objects[] = { 1, std::string("a"), 2 };
+	int total = 0;
+	for (auto& o : objects) {
+		megamorphic_site(o, total);
+	}
+	monomorphic_site(objects[0], total);
+	EXPECT_THAT(total, 5);
+
+	auto counts = polymorphic::profile::call_counts();
+	std::set<const void*> sites;
+	for (auto& c : counts) sites.insert(c.site);
+	EXPECT_THAT(sites.size(), 2);
+
+	std::ostringstream os;
+	polymorphic::profile::report(os);
+	EXPECT_THAT(os.str(), testing::HasSubstr("2 types, 3 calls"));
+	EXPECT_THAT(os.str(), testing::HasSubstr("1 types, 1 calls"));
+}
+
+
+
+
+
+int main(int argc, char **argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
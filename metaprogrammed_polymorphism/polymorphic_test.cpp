@@ -12,7 +12,13 @@
 // limitations under the License.
 
 #include <gmock/gmock.h>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <string>
+#include <thread>
+#include <vector>
 #include "polymorphic.hpp"
 
 struct x2 {};
@@ -164,6 +170,494 @@ TEST(Polymorphic, CopyConstRefFromObject) {
 
 }
 
+struct throwing_move {
+	throwing_move() = default;
+	throwing_move(const throwing_move&) = default;
+	throwing_move(throwing_move&&) noexcept(false) {}
+	int value = 7;
+};
+
+int poly_extend(stupid_hash, const throwing_move& t) { return t.value; }
+void poly_extend(x2, throwing_move& t) { t.value *= 2; }
+
+template <typename Object>
+bool is_stored_inline(const Object& o) {
+	auto begin = reinterpret_cast<const char*>(&o);
+	auto p = static_cast<const char*>(o.get_ptr());
+	return p >= begin && p < begin + sizeof(o);
+}
+
+TEST(Polymorphic, SmallObjectStoredInline) {
+	polymorphic::object<void(x2), int(stupid_hash)const> o{ 5 };
+	EXPECT_TRUE(is_stored_inline(o));
+	o.call<x2>();
+	auto o2 = o;
+	EXPECT_TRUE(is_stored_inline(o2));
+	o2.call<x2>();
+	EXPECT_THAT(o.call<stupid_hash>(), 10);
+	EXPECT_THAT(o2.call<stupid_hash>(), 20);
+
+	auto o3 = std::move(o2);
+	EXPECT_TRUE(is_stored_inline(o3));
+	EXPECT_THAT(o3.call<stupid_hash>(), 20);
+}
+
+TEST(Polymorphic, LargeOrThrowingMoveObjectOnHeap) {
+	polymorphic::object<void(x2), int(stupid_hash)const> o{ std::string(100, 'a') };
+	EXPECT_FALSE(is_stored_inline(o));
+	auto p = o.get_ptr();
+	auto o2 = std::move(o);
+	EXPECT_THAT(o2.get_ptr(), p);
+	EXPECT_THAT(o2.call<stupid_hash>(), 100);
+
+	polymorphic::basic_object<64, alignof(std::max_align_t), void(x2), int(stupid_hash)const> t{ throwing_move{} };
+	EXPECT_FALSE(is_stored_inline(t));
+	auto t2 = t;
+	t2.call<x2>();
+	EXPECT_THAT(t.call<stupid_hash>(), 7);
+	EXPECT_THAT(t2.call<stupid_hash>(), 14);
+}
+
+TEST(Polymorphic, ConfigurableInlineSize) {
+	polymorphic::basic_object<sizeof(std::string), alignof(std::string), void(x2), int(stupid_hash)const> o{ std::string("hello") };
+	EXPECT_TRUE(is_stored_inline(o));
+	auto o2 = o;
+	o2.call<x2>();
+	EXPECT_THAT(o.call<stupid_hash>(), 5);
+	EXPECT_THAT(o2.call<stupid_hash>(), 10);
+	o = std::move(o2);
+	EXPECT_TRUE(is_stored_inline(o));
+	EXPECT_THAT(o.call<stupid_hash>(), 10);
+}
+
+
+TEST(Polymorphic, InlineRef) {
+	std::string s("hello");
+	int i = 5;
+
+	polymorphic::inline_ref<void(x2), int(stupid_hash)const> r{ s };
+	static_assert(sizeof(r) == 3 * sizeof(void*));
+	r.call<x2>();
+	EXPECT_THAT(r.call<stupid_hash>(), 10);
+	r = i;
+	r.call<x2>();
+	EXPECT_THAT(r.call<stupid_hash>(), 10);
+	EXPECT_THAT(s, "hellohello");
+
+	polymorphic::inline_ref<int(stupid_hash)const> r2 = r;
+	static_assert(sizeof(r2) == 2 * sizeof(void*));
+	EXPECT_THAT(r2.call<stupid_hash>(), 10);
+}
+
+TEST(Polymorphic, InlineRefFromObjectAndRef) {
+	polymorphic::object<void(x2), int(stupid_hash)const> o{ 5 };
+	polymorphic::inline_ref<int(stupid_hash)const, void(x2)> r = o;
+	r.call<x2>();
+	EXPECT_THAT(o.call<stupid_hash>(), 10);
+
+	polymorphic::ref<void(x2), int(stupid_hash)const> r2 = o;
+	polymorphic::inline_ref<int(stupid_hash)const> r3 = std::as_const(r2);
+	r2.call<x2>();
+	EXPECT_THAT(r3.call<stupid_hash>(), 20);
+
+	using big_ref = polymorphic::inline_ref<void(x2), int(stupid_hash)const, void(x2, int)>;
+	static_assert(std::is_same_v<big_ref, polymorphic::ref<void(x2), int(stupid_hash)const, void(x2, int)>>);
+}
+
+
+struct accumulate {};
+void poly_extend(accumulate, const int& i, int& total) { total += i; }
+void poly_extend(accumulate, const std::string& s, int& total) {
+	total += static_cast<int>(s.size());
+}
+
+TEST(Polymorphic, PolyCollection) {
+	polymorphic::poly_collection<void(x2), void(accumulate, int&)const> c;
+	c.insert(1);
+	c.insert(std::string("a"));
+	c.insert(2);
+	c.emplace<std::string>("bc");
+	EXPECT_THAT(c.size(), 4);
+	EXPECT_THAT(c.segment_count(), 2);
+
+	int total = 0;
+	std::as_const(c).for_each_call<accumulate>(total);
+	EXPECT_THAT(total, 6);
+
+	c.for_each_call<x2>();
+	total = 0;
+	c.for_each_call<accumulate>(total);
+	EXPECT_THAT(total, 12);
+
+	c.clear();
+	EXPECT_THAT(c.size(), 0);
+}
+
+struct append_to {};
+void poly_extend(append_to, const int& i, std::string suffix, std::string& out) {
+	out += std::to_string(i) + suffix;
+}
+void poly_extend(append_to, const std::string& s, std::string suffix, std::string& out) {
+	out += s + suffix;
+}
+
+TEST(Polymorphic, PolyCollectionRvalueParameter) {
+	polymorphic::poly_collection<void(append_to, std::string, std::string&)const> c;
+	c.insert(1);
+	c.insert(std::string("a"));
+	c.insert(2);
+
+	std::string out;
+	c.for_each_call<append_to>(std::string("-suffix-that-is-not-small"), out);
+	EXPECT_THAT(out, "1-suffix-that-is-not-small2-suffix-that-is-not-small"
+		"a-suffix-that-is-not-small");
+}
+
+
+struct square {};
+
+int poly_extend(square, const int& i) { return i * i; }
+int poly_extend(square, const std::string& s) { return static_cast<int>(s.size() * s.size()); }
+
+int square_batch_calls = 0;
+void poly_extend(square, std::span<const int> values, std::span<int> out) {
+	++square_batch_calls;
+	for (std::size_t i = 0; i < values.size(); ++i) out[i] = values[i] * values[i];
+}
+
+void poly_extend(x2, std::span<int> values) {
+	++square_batch_calls;
+	for (auto& v : values) v *= 2;
+}
+
+TEST(Polymorphic, PolyCollectionCallBatch) {
+	polymorphic::poly_collection<void(x2), int(square)const> c;
+	c.insert(1);
+	c.insert(std::string("abc"));
+	c.insert(2);
+
+	std::vector<int> out(c.size());
+	std::as_const(c).call_batch<square>(std::span<int>(out));
+	EXPECT_THAT(out, testing::ElementsAre(1, 4, 9));
+	EXPECT_THAT(square_batch_calls, 1);
+
+	c.call_batch<x2>();
+	EXPECT_THAT(square_batch_calls, 2);
+	c.call_batch<square>(out);
+	EXPECT_THAT(out, testing::ElementsAre(4, 16, 36));
+	EXPECT_THAT(square_batch_calls, 3);
+}
+
+TEST(Polymorphic, PolyCollectionCallBatchChecksOutSize) {
+	polymorphic::poly_collection<int(square)const> c;
+	c.insert(1);
+	c.insert(std::string("abc"));
+
+	std::vector<int> out(1);
+	EXPECT_DEBUG_DEATH(c.call_batch<square>(std::span<int>(out)), "size\\(\\) results");
+}
+
+
+class counting_resource : public std::pmr::memory_resource {
+	std::pmr::monotonic_buffer_resource upstream_;
+
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+		++allocations;
+		return upstream_.allocate(bytes, alignment);
+	}
+	void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+		++deallocations;
+		upstream_.deallocate(p, bytes, alignment);
+	}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+		return this == &other;
+	}
+
+public:
+	int allocations = 0;
+	int deallocations = 0;
+};
+
+TEST(Polymorphic, ArenaObject) {
+	counting_resource arena;
+	{
+		polymorphic::arena_object<void(x2), int(stupid_hash)const> o{ polymorphic::in_arena(arena, 5) };
+		EXPECT_THAT(arena.allocations, 1);
+		auto o2 = o;
+		EXPECT_THAT(arena.allocations, 2);
+		o2.call<x2>();
+		EXPECT_THAT(o.call<stupid_hash>(), 5);
+		EXPECT_THAT(o2.call<stupid_hash>(), 10);
+
+		auto o3 = std::move(o2);
+		EXPECT_THAT(arena.allocations, 2);
+		EXPECT_THAT(o3.call<stupid_hash>(), 10);
+
+		polymorphic::ref<int(stupid_hash)const> r = std::as_const(o3);
+		EXPECT_THAT(r.call<stupid_hash>(), 10);
+	}
+	EXPECT_THAT(arena.deallocations, 2);
+}
+
+TEST(Polymorphic, ArenaObjectCopiesValueFromInArena) {
+	counting_resource arena;
+	{
+		polymorphic::arena_object<void(x2), int(stupid_hash)const> o =
+			polymorphic::in_arena(arena, std::string(40, 'a'));
+		auto o2 = o;
+		o2.call<x2>();
+		EXPECT_THAT(o.call<stupid_hash>(), 40);
+		EXPECT_THAT(o2.call<stupid_hash>(), 80);
+		o = o2;
+		EXPECT_THAT(o.call<stupid_hash>(), 80);
+	}
+	EXPECT_THAT(arena.allocations, 3);
+	EXPECT_THAT(arena.deallocations, 3);
+}
+
+TEST(Polymorphic, ArenaObjectSkipsTrivialDestructors) {
+	counting_resource arena;
+	{
+		using arena_object = polymorphic::basic_arena_object<polymorphic::arena_destroy::non_trivial_only,
+			void(x2), int(stupid_hash)const>;
+		std::vector<arena_object> objects;
+		objects.emplace_back(polymorphic::in_arena(arena, 5));
+		objects.emplace_back(polymorphic::in_arena(arena, std::string("hello")));
+		auto copy = objects;
+		for (auto& o : copy) o.call<x2>();
+		EXPECT_THAT(objects[0].call<stupid_hash>(), 5);
+		EXPECT_THAT(copy[0].call<stupid_hash>(), 10);
+		EXPECT_THAT(copy[1].call<stupid_hash>(), 10);
+		EXPECT_THAT(arena.allocations, 4);
+	}
+	// Only the std::string values are destroyed.
+	EXPECT_THAT(arena.deallocations, 2);
+}
+
+
+TEST(Polymorphic, CowObject) {
+	polymorphic::cow_object<void(x2), int(stupid_hash)const> o{ std::string("hello") };
+	auto o2 = o;
+	EXPECT_THAT(std::as_const(o2).get_ptr(), std::as_const(o).get_ptr());
+
+	// Const signatures do not unshare.
+	EXPECT_THAT(o2.call<stupid_hash>(), 5);
+	EXPECT_THAT(std::as_const(o2).get_ptr(), std::as_const(o).get_ptr());
+
+	o2.call<x2>();
+	EXPECT_NE(std::as_const(o2).get_ptr(), std::as_const(o).get_ptr());
+	EXPECT_THAT(o.call<stupid_hash>(), 5);
+	EXPECT_THAT(o2.call<stupid_hash>(), 10);
+
+	// Not shared anymore, so no clone.
+	auto p = std::as_const(o).get_ptr();
+	o.call<x2>();
+	EXPECT_THAT(std::as_const(o).get_ptr(), p);
+	EXPECT_THAT(o.call<stupid_hash>(), 10);
+}
+
+TEST(Polymorphic, CowObjectRefs) {
+	polymorphic::cow_object<void(x2), int(stupid_hash)const> o{ 5 };
+	auto o2 = o;
+	polymorphic::ref<int(stupid_hash)const> cr = std::as_const(o2);
+	EXPECT_THAT(cr.get_ptr(), std::as_const(o).get_ptr());
+
+	polymorphic::ref<void(x2)> r = o2;
+	r.call<x2>();
+	EXPECT_THAT(o.call<stupid_hash>(), 5);
+	EXPECT_THAT(o2.call<stupid_hash>(), 10);
+}
+
+TEST(Polymorphic, CowObjectConstRefOutlivesSharing) {
+	polymorphic::cow_object<void(x2), int(stupid_hash)const> o{ std::string("hello") };
+	std::optional<decltype(o)> copy = o;
+	polymorphic::ref<int(stupid_hash)const> r = o;
+	EXPECT_NE(r.get_ptr(), std::as_const(*copy).get_ptr());
+
+	o.call<x2>();
+	copy.reset();
+	EXPECT_THAT(r.call<stupid_hash>(), 10);
+}
+
+TEST(Polymorphic, CowObjectCopyWhileMutableRefIsInUse) {
+	polymorphic::cow_object<void(x2), int(stupid_hash)const> o{ std::string("hello") };
+	polymorphic::ref<void(x2)> r = o;
+	auto snapshot = o;
+	EXPECT_NE(std::as_const(snapshot).get_ptr(), std::as_const(o).get_ptr());
+	r.call<x2>();
+	EXPECT_THAT(o.call<stupid_hash>(), 10);
+	EXPECT_THAT(snapshot.call<stupid_hash>(), 5);
+
+	// Copies of the snapshot share again.
+	auto o3 = snapshot;
+	EXPECT_THAT(std::as_const(o3).get_ptr(), std::as_const(snapshot).get_ptr());
+}
+
+
+struct alignas(64) over_aligned {
+	int value = 3;
+};
+
+int poly_extend(stupid_hash, const over_aligned& o) { return o.value; }
+void poly_extend(x2, over_aligned& o) { o.value *= 2; }
+
+TEST(Polymorphic, ObjectMovedFrom) {
+	polymorphic::object<void(x2), int(stupid_hash)const> o{ over_aligned{} };
+	EXPECT_THAT(reinterpret_cast<std::uintptr_t>(o.get_ptr()) % 64, 0);
+	EXPECT_TRUE(o);
+	auto p = o.get_ptr();
+	auto o2 = std::move(o);
+	EXPECT_FALSE(o);
+	EXPECT_THAT(o2.get_ptr(), p);
+
+	auto o3 = o2;
+	o3.call<x2>();
+	EXPECT_THAT(reinterpret_cast<std::uintptr_t>(o3.get_ptr()) % 64, 0);
+	EXPECT_THAT(o2.call<stupid_hash>(), 3);
+	EXPECT_THAT(o3.call<stupid_hash>(), 6);
+
+	o = o3;
+	EXPECT_TRUE(o);
+	EXPECT_THAT(o.call<stupid_hash>(), 6);
+}
+
+TEST(Polymorphic, ConstObjectFromMutableObject) {
+	polymorphic::object<void(x2), int(stupid_hash)const> o{ std::string("hello") };
+	polymorphic::object<int(stupid_hash)const> co = o;
+	o.call<x2>();
+	EXPECT_THAT(co.call<stupid_hash>(), 5);
+	auto co2 = co;
+	EXPECT_THAT(co2.get_ptr(), co.get_ptr());
+}
+
+
+struct collide {};
+
+std::string poly_extend(collide, const int&, const int&) { return "int int"; }
+std::string poly_extend(collide, const int&, const std::string&) { return "int string"; }
+std::string poly_extend(collide, const std::string&, const int&) { return "string int"; }
+std::string poly_extend(collide, const std::string& a, const std::string& b) { return a + b; }
+void poly_extend(collide, int& a, int& b, int n) { a += n; b += n; }
+void poly_extend(collide, int& a, std::string& b, int n) { a += n; b += std::to_string(n); }
+template <typename A, typename B>
+void poly_extend(collide, A&, B&, int) {}
+
+using collide_types = polymorphic::type_list<int, std::string>;
+
+TEST(Polymorphic, Dispatch2) {
+	using collide_ref = polymorphic::ref<std::size_t(polymorphic::type_index<collide_types>)const>;
+	int i = 1;
+	std::string s = "hello";
+	collide_ref ri = std::as_const(i);
+	collide_ref rs = std::as_const(s);
+
+	EXPECT_THAT(polymorphic::dispatch2<collide>(ri, ri), "int int");
+	EXPECT_THAT(polymorphic::dispatch2<collide>(ri, rs), "int string");
+	EXPECT_THAT(polymorphic::dispatch2<collide>(rs, ri), "string int");
+	EXPECT_THAT(polymorphic::dispatch2<collide>(rs, rs), "hellohello");
+
+	EXPECT_THAT(rs.call<polymorphic::type_index<collide_types>>(), 1);
+	polymorphic::inline_ref<std::size_t(polymorphic::type_index<collide_types>)const> is = rs;
+	EXPECT_THAT(is.call<polymorphic::type_index<collide_types>>(), 1);
+	EXPECT_THAT(polymorphic::dispatch2<collide>(ri, is), "int string");
+}
+
+TEST(Polymorphic, Dispatch2Mutable) {
+	using collide_object = polymorphic::object<void(x2),
+		std::size_t(polymorphic::type_index<collide_types>)const>;
+	collide_object a{ 1 };
+	collide_object b{ std::string("a") };
+	polymorphic::dispatch2<collide>(a, b, 2);
+	polymorphic::dispatch2<collide>(a, a, 1);
+	polymorphic::dispatch2<collide>(b, a, 1);
+	EXPECT_THAT(*static_cast<int*>(a.get_ptr()), 5);
+	EXPECT_THAT(*static_cast<std::string*>(b.get_ptr()), "a2");
+}
+
+TEST(Polymorphic, AtomicShared) {
+	polymorphic::atomic_shared<int(stupid_hash)const> a{ 5 };
+	EXPECT_THAT(a.call<stupid_hash>(), 5);
+	{
+		auto r = a.read();
+		auto inner = a.read();
+		EXPECT_THAT(r.call<stupid_hash>(), 5);
+		polymorphic::ref<int(stupid_hash)const> ref = r.get();
+		EXPECT_THAT(ref.call<stupid_hash>(), 5);
+	}
+	a.store(std::string("hello"));
+	EXPECT_THAT(a.call<stupid_hash>(), 5);
+	a.store(7);
+	EXPECT_THAT(a.call<stupid_hash>(), 7);
+}
+
+TEST(Polymorphic, AtomicSharedConcurrentStore) {
+	polymorphic::atomic_shared<int(stupid_hash)const> a{ std::string(10, 'a') };
+	std::atomic<bool> done{ false };
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 4; ++t) {
+		readers.emplace_back([&] {
+			while (!done.load()) {
+				auto r = a.read();
+				auto n = r.call<stupid_hash>();
+				EXPECT_TRUE(n == 10 || n == 20);
+			}
+			});
+	}
+	for (int i = 0; i < 100; ++i) {
+		a.store(std::string(i % 2 ? 20 : 10, 'a'));
+	}
+	done = true;
+	for (auto& t : readers) t.join();
+	EXPECT_THAT(a.call<stupid_hash>(), 20);
+}
+
+TEST(Polymorphic, SealedObject) {
+	using sealed = polymorphic::sealed_object<polymorphic::type_list<int, std::string>,
+		void(x2), int(stupid_hash)const>;
+	sealed o{ std::string("hello") };
+	EXPECT_THAT(o.index(), 1);
+	EXPECT_THAT(o.call<stupid_hash>(), 5);
+	auto o2 = o;
+	o.call<x2>();
+	EXPECT_THAT(o.call<stupid_hash>(), 10);
+	EXPECT_THAT(o2.call<stupid_hash>(), 5);
+	EXPECT_THAT(*static_cast<std::string*>(o.get_ptr()), "hellohello");
+
+	o = 4;
+	EXPECT_THAT(o.index(), 0);
+	o.call<x2>();
+	const sealed& co = o;
+	EXPECT_THAT(co.call<stupid_hash>(), 8);
+
+	std::vector<sealed> v{ 1, std::string("ab"), 3 };
+	int sum = 0;
+	for (auto& e : v) sum += e.call<stupid_hash>();
+	EXPECT_THAT(sum, 6);
+}
+
+struct throwing_copy {
+	throwing_copy() = default;
+	throwing_copy(const throwing_copy&) { throw 1; }
+	throwing_copy(throwing_copy&&) noexcept(false) {}
+	throwing_copy& operator=(const throwing_copy&) = default;
+};
+
+int poly_extend(stupid_hash, const throwing_copy&) { return 0; }
+void poly_extend(x2, throwing_copy&) {}
+
+TEST(Polymorphic, SealedObjectValuelessByException) {
+	using sealed = polymorphic::sealed_object<polymorphic::type_list<int, throwing_copy>,
+		void(x2), int(stupid_hash)const>;
+	sealed o{ 5 };
+	const sealed t{ throwing_copy{} };
+	EXPECT_THROW(o = t, int);
+	EXPECT_THAT(o.index(), std::variant_npos);
+	EXPECT_THAT(o.get_ptr(), nullptr);
+	EXPECT_THROW(o.call<x2>(), std::bad_variant_access);
+	EXPECT_THROW(std::as_const(o).call<stupid_hash>(), std::bad_variant_access);
+}
+
+
 
 
 